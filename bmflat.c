@@ -1,623 +1,4197 @@
 #include "bmflat.h"
 
-#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <time.h>
+
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#define sys_open(_path)         _open(_path, _O_RDONLY | _O_BINARY)
+#define sys_read(_fd, _buf, _n) _read(_fd, _buf, (unsigned)(_n))
+#define sys_close(_fd)          _close(_fd)
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define sys_open(_path)         open(_path, O_RDONLY)
+#define sys_read(_fd, _buf, _n) read(_fd, _buf, _n)
+#define sys_close(_fd)          close(_fd)
+#endif
+
+#if !defined(_WIN32) && !defined(BM_NO_THREADS)
+#include <pthread.h>
+#define BM_THREADS
+#endif
+
+#if !defined(BM_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define BM_SSE2
+#if defined(__GNUC__) || defined(__clang__)
+#include <immintrin.h>
+#define BM_AVX2
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || \
+    defined(_M_X64) || defined(_M_IX86) || defined(_M_ARM64)
+#define BM_LITTLE_ENDIAN
+#endif
+
+// Memory allocation
+
+static void *std_alloc(void *user, size_t size)
+{
+    (void)user;
+    return malloc(size);
+}
+
+static void *std_realloc(void *user, void *ptr, size_t size)
+{
+    (void)user;
+    return realloc(ptr, size);
+}
+
+static void std_free(void *user, void *ptr)
+{
+    (void)user;
+    free(ptr);
+}
+
+static const struct bm_allocator std_allocator = {
+    std_alloc, std_realloc, std_free, NULL
+};
+static const struct bm_allocator *default_allocator = &std_allocator;
+
+void bm_set_allocator(const struct bm_allocator *alloc)
+{
+    default_allocator = (alloc != NULL ? alloc : &std_allocator);
+}
+
+static inline const struct bm_allocator *get_allocator(const struct bm_allocator *alloc)
+{
+    return (alloc != NULL ? alloc : default_allocator);
+}
+
+#define mem_alloc(_a, _size)        ((_a)->alloc_fn((_a)->user, (_size)))
+#define mem_realloc(_a, _p, _size)  ((_a)->realloc_fn((_a)->user, (_p), (_size)))
+#define mem_free(_a, _p) do { \
+    if ((_p) != NULL) (_a)->free_fn((_a)->user, (_p)); \
+} while (0)
+
 struct bm_log *bm_logs = NULL;
-static int log_cap, log_ptr;
 
-static void reset_logs()
+// Backs the non-reentrant API that reports through bm_logs
+static struct bm_parse_ctx global_ctx = { 0, 0, NULL, BM_LOG_UNLIMITED, 0, NULL };
+
+void bm_init_ctx(struct bm_parse_ctx *ctx)
+{
+    ctx->log_count = ctx->log_cap = 0;
+    ctx->logs = NULL;
+    ctx->log_limit = BM_LOG_UNLIMITED;
+    ctx->log_total = 0;
+    ctx->alloc = NULL;
+}
+
+void bm_close_ctx(struct bm_parse_ctx *ctx)
 {
-    if (bm_logs) free(bm_logs);
-    bm_logs = NULL;
-    log_cap = log_ptr = 0;
+    mem_free(get_allocator(ctx->alloc), ctx->logs);
+    ctx->log_count = ctx->log_cap = 0;
+    ctx->logs = NULL;
 }
 
-static void ensure_log_cap()
+// Kept out of line, as most lines report nothing
+static void push_log(struct bm_parse_ctx *ctx, int line, int code,
+    int a, int b, const char *text, int text_len)
 {
-    if (log_cap <= log_ptr) {
-        log_cap = (log_cap == 0 ? 8 : (log_cap << 1));
-        bm_logs = (struct bm_log *)
-            realloc(bm_logs, log_cap * sizeof(struct bm_log));
+    if (ctx->log_cap <= ctx->log_count) {
+        int cap = (ctx->log_cap == 0 ? 8 : (ctx->log_cap << 1));
+        struct bm_log *logs = (struct bm_log *)mem_realloc(
+            get_allocator(ctx->alloc), ctx->logs, cap * sizeof(struct bm_log));
+        if (logs == NULL) return;
+        ctx->logs = logs;
+        ctx->log_cap = cap;
     }
+    struct bm_log *log = &ctx->logs[ctx->log_count++];
+    log->line = line;
+    log->code = code;
+    log->a = a;
+    log->b = b;
+    if (text_len > (int)sizeof log->text - 1) text_len = sizeof log->text - 1;
+    if (text_len > 0) memcpy(log->text, text, text_len);
+    log->text[text_len] = '\0';
 }
 
-#define emit_log(_line, ...) do { \
-    ensure_log_cap(); \
-    bm_logs[log_ptr].line = _line; \
-    snprintf(bm_logs[log_ptr].message, BM_MSG_LEN, __VA_ARGS__); \
-    log_ptr++; \
+// Expects `ctx` to be in scope; costs a count and a comparison
+// when the diagnostic is not kept
+#define emit_log(_line, _code, _a, _b, _text, _text_len) do { \
+    ctx->log_total++; \
+    if (ctx->log_count < ctx->log_limit) \
+        push_log(ctx, _line, _code, _a, _b, _text, _text_len); \
 } while (0)
+#define emit_log_int(_line, _code, _a)  emit_log(_line, _code, _a, 0, NULL, 0)
+#define emit_log_text(_line, _code, _text, _text_len) \
+    emit_log(_line, _code, 0, 0, _text, _text_len)
+
+// How the arguments of each code are passed to its format
+enum log_args { ARGS_NONE, ARGS_INT, ARGS_INT2, ARGS_FLOAT2, ARGS_TEXT, ARGS_TEXT_INT };
+
+static const struct {
+    const char *format;
+    enum log_args args;
+} log_formats[] = {
+    [BM_LOG_TOO_MANY_ENTRIES] =
+        { "Too many entries in one line (more than %d), ignoring", ARGS_INT },
+    [BM_LOG_TRAILING_CHAR] =
+        { "Extraneous trailing character %s, ignoring", ARGS_TEXT },
+    [BM_LOG_INVALID_PAIR] =
+        { "Invalid base-36 index %s at column %d, ignoring", ARGS_TEXT_INT },
+    [BM_LOG_TRACK_REDEFINED] =
+        { "Track %02d already defined previously, merging all notes", ARGS_INT },
+    [BM_LOG_INEXACT_TIME_SIG] =
+        { "Inaccurate time signature, treating as %d/4", ARGS_INT },
+    [BM_LOG_TIME_SIG_REDEFINED] =
+        { "Time signature for bar %03d defined multiple times, overwriting", ARGS_INT },
+    [BM_LOG_INVALID_TIME_SIG] =
+        { "Invalid time signature, should be a multiple of 0.25 "
+            "between 0.25 and 63.75 (inclusive)", ARGS_NONE },
+    [BM_LOG_UNKNOWN_TRACK] =
+        { "Unknown track %s, ignoring", ARGS_TEXT },
+    [BM_LOG_EMPTY_ARGUMENT] =
+        { "Command requires non-empty arguments, ignoring", ARGS_NONE },
+    [BM_LOG_INVALID_INT] =
+        { "Invalid integral value, should be between %d and %d (inclusive)", ARGS_INT2 },
+    [BM_LOG_INVALID_FLOAT] =
+        { "Invalid integral value, should be between %g and %g (inclusive)", ARGS_FLOAT2 },
+    [BM_LOG_UNKNOWN_COMMAND] =
+        { "Unrecognized command %s, ignoring", ARGS_TEXT },
+    [BM_LOG_COMMAND_REDEFINED] =
+        { "Multiple %s commands, overwritten", ARGS_TEXT },
+    [BM_LOG_WAV_REDEFINED] =
+        { "Wave %s specified multiple times, overwritten", ARGS_TEXT },
+    [BM_LOG_BMP_REDEFINED] =
+        { "Bitmap %s specified multiple times, overwritten", ARGS_TEXT },
+    [BM_LOG_TEMPO_REDEFINED] =
+        { "Tempo %s specified multiple times, overwritten", ARGS_TEXT },
+    [BM_LOG_STOP_REDEFINED] =
+        { "Stop %s specified multiple times, overwritten", ARGS_TEXT },
+    [BM_LOG_INVALID_INDEX] =
+        { "Invalid base-36 index %s, ignoring", ARGS_TEXT },
+    [BM_LOG_MISSING_INT] =
+        { "Command %s did not appear, defaulting to %d", ARGS_TEXT_INT },
+    [BM_LOG_MISSING_STRING] =
+        { "Command %s did not appear, defaulting to (unknown)", ARGS_TEXT },
+    [BM_LOG_UNMATCHED_CONTROL] =
+        { "Unmatched %s, ignoring", ARGS_TEXT },
+    [BM_LOG_MISSING_ENDIF] =
+        { "IF without ENDIF, closed at the end", ARGS_NONE },
+};
+
+int bm_log_message(const struct bm_log *log, char *buf, size_t size)
+{
+    if (log->code >= sizeof log_formats / sizeof log_formats[0])
+        return snprintf(buf, size, "Unknown diagnostic %d", log->code);
+    const char *format = log_formats[log->code].format;
+    switch (log_formats[log->code].args) {
+    case ARGS_INT: return snprintf(buf, size, format, log->a);
+    case ARGS_INT2: return snprintf(buf, size, format, log->a, log->b);
+    case ARGS_FLOAT2: return snprintf(buf, size, format, (double)log->a, (double)log->b);
+    case ARGS_TEXT: return snprintf(buf, size, format, log->text);
+    case ARGS_TEXT_INT: return snprintf(buf, size, format, log->text, log->a);
+    default: return snprintf(buf, size, "%s", format);
+    }
+}
 
 static inline int is_space_or_linebreak(char ch)
 {
     return ch == '\r' || ch == '\n' || ch == '\0';
 }
 
-static inline int isbase36(char ch)
+static inline int is_blank(char ch)
 {
-    return (ch >= '0' && ch <= '9') || (ch >= 'A' && ch <= 'Z');
+    // isspace() in the C locale, excluding line breaks
+    return ch == ' ' || ch == '\t' || ch == '\v' || ch == '\f';
 }
 
-static inline int base36(char c1, char c2)
+static inline int is_digit(char ch)
 {
-    // Assumes isbase36(c1) and isbase36(c2) are true
-    return
-        (c1 <= '9' ? c1 - '0' : c1 - 'A' + 10) * 36 +
-        (c2 <= '9' ? c2 - '0' : c2 - 'A' + 10);
+    return ch >= '0' && ch <= '9';
 }
 
-static inline void add_note(struct bm_track *track, short bar, float beat, short value)
+static inline int ctz32(uint32_t x)
 {
-    if (track->note_cap <= track->note_count) {
-        track->note_cap = (track->note_cap == 0 ? 8 : (track->note_cap << 1));
-        track->notes = (struct bm_note *)
-            realloc(track->notes, track->note_cap * sizeof(struct bm_note));
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(x);
+#elif defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (int)i;
+#else
+    int i = 0;
+    while (!(x & 1)) { x >>= 1; i++; }
+    return i;
+#endif
+}
+
+// Digests
+// MD5 and SHA-256 of the source, updated with each batch of scanned lines
+// while it is still in cache
+
+struct digest_state {
+    uint64_t len;
+    uint32_t md5[4];
+    uint32_t sha256[8];
+    unsigned char buf[64];  // Incomplete block
+};
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotl32(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static inline uint32_t load_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint32_t load_be32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void md5_blocks(uint32_t *state, const unsigned char *p, size_t blocks)
+{
+    for (; blocks > 0; blocks--, p += 64) {
+        uint32_t w[16];
+        for (int i = 0; i < 16; i++) w[i] = load_le32(p + i * 4);
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        // Four steps at a time, so that the rotations are constants
+        // and the variables need not be shifted along
+        #define md5_f(_b, _c, _d) ((_d) ^ ((_b) & ((_c) ^ (_d))))
+        #define md5_g(_b, _c, _d) ((_c) ^ ((_d) & ((_b) ^ (_c))))
+        #define md5_h(_b, _c, _d) ((_b) ^ (_c) ^ (_d))
+        #define md5_i(_b, _c, _d) ((_c) ^ ((_b) | ~(_d)))
+        #define md5_step(_fn, _a, _b, _c, _d, _i, _g, _s) \
+            (_a) = (_b) + rotl32((_a) + _fn(_b, _c, _d) + w[(_g) % 16] + md5_k[_i], _s)
+        #define md5_steps(_fn, _i, _g0, _g1, _g2, _g3, _s0, _s1, _s2, _s3) do { \
+            md5_step(_fn, a, b, c, d, (_i), (_g0), _s0); \
+            md5_step(_fn, d, a, b, c, (_i) + 1, (_g1), _s1); \
+            md5_step(_fn, c, d, a, b, (_i) + 2, (_g2), _s2); \
+            md5_step(_fn, b, c, d, a, (_i) + 3, (_g3), _s3); \
+        } while (0)
+        for (int i = 0; i < 16; i += 4)
+            md5_steps(md5_f, i, i, i + 1, i + 2, i + 3, 7, 12, 17, 22);
+        for (int i = 16; i < 32; i += 4)
+            md5_steps(md5_g, i, 5 * i + 1, 5 * i + 6, 5 * i + 11, 5 * i + 16, 5, 9, 14, 20);
+        for (int i = 32; i < 48; i += 4)
+            md5_steps(md5_h, i, 3 * i + 5, 3 * i + 8, 3 * i + 11, 3 * i + 14, 4, 11, 16, 23);
+        for (int i = 48; i < 64; i += 4)
+            md5_steps(md5_i, i, 7 * i, 7 * i + 7, 7 * i + 14, 7 * i + 21, 6, 10, 15, 21);
+        #undef md5_f
+        #undef md5_g
+        #undef md5_h
+        #undef md5_i
+        #undef md5_step
+        #undef md5_steps
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
     }
-    track->notes[track->note_count].bar = bar;
-    track->notes[track->note_count].hold = false;
-    track->notes[track->note_count].beat = beat;
-    track->notes[track->note_count++].value = value;
 }
 
-static inline void parse_track(int line, char *s, struct bm_track *track, short bar)
+static void sha256_blocks_scalar(uint32_t *state, const unsigned char *p, size_t blocks)
 {
-    int count = 0;
-    for (char *p = s; *p != '\0'; p++) count += (!isspace(*p));
-    count /= 2;
+    for (; blocks > 0; blocks--, p += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) w[i] = load_be32(p + i * 4);
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotl32(w[i - 15], 25) ^ rotl32(w[i - 15], 14) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotl32(w[i - 2], 15) ^ rotl32(w[i - 2], 13) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
 
-    for (int p = 0, q, i = 0; s[p] != '\0'; p = q + 1) {
-        while (isspace(s[p]) && s[p] != '\0') p++;
-        if (s[p] == '\0') break;
-        q = p + 1;
-        while (isspace(s[q]) && s[q] != '\0') q++;
-        if (s[q] == '\0') {
-            emit_log(line, "Extraneous trailing character %c, ignoring", s[p]);
-            break;
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = rotl32(e, 26) ^ rotl32(e, 21) ^ rotl32(e, 7);
+            uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t s0 = rotl32(a, 30) ^ rotl32(a, 19) ^ rotl32(a, 10);
+            uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
         }
-        if (!isbase36(s[p]) || !isbase36(s[q])) {
-            emit_log(line, "Invalid base-36 index %c%c at column %d, ignoring",
-                s[p], s[q], p + 8);
-            continue;
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#if defined(BM_AVX2) && (defined(__x86_64__) || defined(__i386__))
+#define BM_SHA_NI
+
+// With the SHA extensions, two rounds per instruction
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_ni(uint32_t *state, const unsigned char *p, size_t blocks)
+{
+    const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bll, 0x0405060700010203ll);
+
+    // The instructions keep the state as ABEF and CDGH
+    __m128i t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0xb1);
+    __m128i s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(state + 4)), 0x1b);
+    __m128i s0 = _mm_alignr_epi8(t, s1, 8);
+    s1 = _mm_blend_epi16(s1, t, 0xf0);
+
+    for (; blocks > 0; blocks--, p += 64) {
+        __m128i save0 = s0, save1 = s1;
+        __m128i m[4];
+        for (int i = 0; i < 16; i++) {
+            // Words 4i to 4i + 3 of the schedule replace those 16 words before
+            if (i < 4) {
+                m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + i * 16)), swap);
+            } else {
+                __m128i x = _mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]);
+                x = _mm_add_epi32(x, _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4));
+                m[i & 3] = _mm_sha256msg2_epu32(x, m[(i + 3) & 3]);
+            }
+            __m128i k = _mm_add_epi32(m[i & 3],
+                _mm_loadu_si128((const __m128i *)(sha256_k + i * 4)));
+            s1 = _mm_sha256rnds2_epu32(s1, s0, k);
+            s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(k, 0x0e));
         }
-        int value = base36(s[p], s[q]);
-        if (value != 0) add_note(track, bar, (float)i / count, value);
-        i++;
+        s0 = _mm_add_epi32(s0, save0);
+        s1 = _mm_add_epi32(s1, save1);
     }
+
+    t = _mm_shuffle_epi32(s0, 0x1b);
+    s1 = _mm_shuffle_epi32(s1, 0xb1);
+    _mm_storeu_si128((__m128i *)state, _mm_blend_epi16(t, s1, 0xf0));
+    _mm_storeu_si128((__m128i *)(state + 4), _mm_alignr_epi8(s1, t, 8));
 }
 
-static int note_time_compare(const void *_lhs, const void *_rhs)
+// Along with the byte shuffles and blends used around the rounds; the
+// features are detected once at startup, so this is safe on any thread
+static inline bool has_sha_ni()
 {
-    const struct bm_note *lhs = (const struct bm_note *)_lhs;
-    const struct bm_note *rhs = (const struct bm_note *)_rhs;
-    float diff = (lhs->bar - rhs->bar) + (lhs->beat - rhs->beat);
-    return (diff < -1e-6 ? -1 : (diff > +1e-6 ? +1 : 0));
+    return __builtin_cpu_supports("sha") && __builtin_cpu_supports("ssse3") &&
+        __builtin_cpu_supports("sse4.1");
 }
+#endif
 
-static inline void sort_track(struct bm_track *track, int *max_bars)
+static inline void sha256_blocks(uint32_t *state, const unsigned char *p, size_t blocks)
 {
-    // A stable sorting algorithm
-    qsort(track->notes, track->note_count,
-        sizeof(struct bm_note), note_time_compare);
-    // Remove duplicates
-    int p, q;
-    float last_time = -1;
-    for (p = 0, q = -1; p < track->note_count; p++) {
-        float cur_time = track->notes[p].bar + track->notes[p].beat;
-        if (cur_time - last_time > 1e-6) q++;
-        if (p != q) track->notes[q] = track->notes[p];
-        last_time = cur_time;
+#ifdef BM_SHA_NI
+    if (has_sha_ni()) {
+        sha256_blocks_ni(state, p, blocks);
+        return;
     }
-    track->note_count = q + 1;
+#endif
+    sha256_blocks_scalar(state, p, blocks);
+}
 
-    // Update maximum bar number
-    if (track->note_count > 0 &&
-        *max_bars < track->notes[track->note_count - 1].bar)
-    {
-        *max_bars = track->notes[track->note_count - 1].bar;
+static void init_digest(struct digest_state *d)
+{
+    static const uint32_t md5_init[4] = {
+        0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+    };
+    static const uint32_t sha256_init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    d->len = 0;
+    memcpy(d->md5, md5_init, sizeof d->md5);
+    memcpy(d->sha256, sha256_init, sizeof d->sha256);
+}
+
+// Whole blocks are hashed straight from `p`, each by both functions
+// while it is in L1
+static void update_digest(struct digest_state *d, const char *p, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)p;
+    size_t used = d->len % 64;
+    d->len += len;
+
+    if (used > 0) {
+        size_t n = (len < 64 - used ? len : 64 - used);
+        memcpy(d->buf + used, s, n);
+        s += n;
+        len -= n;
+        if (used + n < 64) return;
+        md5_blocks(d->md5, d->buf, 1);
+        sha256_blocks(d->sha256, d->buf, 1);
+    }
+
+    #define DIGEST_RUN  64  // Blocks
+    while (len >= 64) {
+        size_t blocks = len / 64;
+        if (blocks > DIGEST_RUN) blocks = DIGEST_RUN;
+        md5_blocks(d->md5, s, blocks);
+        sha256_blocks(d->sha256, s, blocks);
+        s += blocks * 64;
+        len -= blocks * 64;
     }
+    memcpy(d->buf, s, len);
 }
 
-int bm_load(struct bm_chart *chart, const char *_source)
+static void finish_digest(struct digest_state *d, struct bm_digests *out)
 {
-    char *source = strdup(_source);
+    uint64_t bits = d->len * 8;
+    size_t used = d->len % 64;
+    unsigned char pad[72] = { 0x80 };
+    size_t n = (used < 56 ? 56 - used : 120 - used);
 
-    chart->meta.player_num = -1;
-    chart->meta.genre = NULL;
-    chart->meta.title = NULL;
-    chart->meta.artist = NULL;
-    chart->meta.subartist = NULL;
-    chart->meta.init_tempo = -1;
-    chart->meta.play_level = -1;
-    chart->meta.judge_rank = -1;
-    chart->meta.gauge_total = -1;
-    chart->meta.difficulty = -1;    // Omissible
-    chart->meta.stage_file = NULL;
-    chart->meta.banner = NULL;
-    chart->meta.back_bmp = NULL;
-    memset(&chart->tables.wav, 0, sizeof chart->tables.wav);
-    memset(&chart->tables.bmp, 0, sizeof chart->tables.bmp);
-    for (int i = 0; i < BM_INDEX_MAX; i++) chart->tables.tempo[i] = -1;
-    memset(&chart->tables.stop, -1, sizeof chart->tables.stop);
-    memset(&chart->tracks, 0, sizeof chart->tracks);
+    // Both pad identically except for the byte order of the length
+    uint32_t md5[4], sha256[8];
+    struct digest_state t = *d;
+    for (int i = 0; i < 8; i++) pad[n + i] = (unsigned char)(bits >> (i * 8));
+    update_digest(&t, (const char *)pad, n + 8);
+    memcpy(md5, t.md5, sizeof md5);
 
-    reset_logs();
-    int len = strlen(source);
-    int ptr = 0, next = 0, line = 1;
+    t = *d;
+    for (int i = 0; i < 8; i++) pad[n + i] = (unsigned char)(bits >> (56 - i * 8));
+    update_digest(&t, (const char *)pad, n + 8);
+    memcpy(sha256, t.sha256, sizeof sha256);
 
-    // Temporary storage
-    int bg_index[BM_BARS_COUNT] = { 0 };
-    bool track_appeared[BM_BARS_COUNT][60] = { false };
-    int lnobj = -1;
+    for (int i = 0; i < 16; i++) out->md5[i] = (unsigned char)(md5[i / 4] >> (i % 4 * 8));
+    for (int i = 0; i < 32; i++)
+        out->sha256[i] = (unsigned char)(sha256[i / 4] >> (24 - i % 4 * 8));
+}
 
-    for (; ptr != len; ptr = ++next, line++) {
-        // Advance to the next line break
-        while (!is_space_or_linebreak(source[next])) next++;
-        if (source[next] == '\r' && next + 1 < len && source[next + 1] == '\n') next++;
+// Line scanning
+// Line breaks are located with bitmasks over 32-byte blocks, and lines
+// starting with # are collected into batches before being parsed
 
-        // Trim at both ends
-        while (ptr < next && isspace(source[ptr])) ptr++;
-        int end = next;
-        while (end >= ptr && isspace(source[end])) end--;
-        source[++end] = '\0';
+#define SCAN_BLOCK  32
+#define LINE_BATCH  256
 
-        // Comment
-        if (source[ptr] != '#') continue;
+enum scan_mode {
+    SCAN_SCALAR,    // One byte at a time, without masks
+    SCAN_SWAR,      // Masks built byte by byte
+    SCAN_SSE2,
+    SCAN_AVX2,
+};
 
-        // Skip the # character
-        char *s = source + ptr + 1;
-        int line_len = end - ptr - 1;
+struct line_scanner {
+    const char *src;
+    size_t len;
+    size_t pos;         // Start of the next line
+    size_t block;       // Start of the block described by `mask`
+    uint32_t mask;      // Unconsumed line breaks in the block
+    int line;
+    enum scan_mode mode;
+};
 
-        if (line_len >= 6 && isdigit(s[0]) && isdigit(s[1]) && isdigit(s[2]) &&
-            isdigit(s[3]) && isdigit(s[4]) && s[5] == ':')
-        {
-            // Track data
-            int bar = s[0] * 100 + s[1] * 10 + s[2] - '0' * 111;
-            int track = s[3] * 10 + s[4] - '0' * 11;
+struct line_entry {
+    int start, len;     // Trimmed, excluding the # character
+    int line;
+    bool is_track;
+};
 
-            if (track >= 3 && track <= 69 && track != 5 && track % 10 != 0 &&
-                track_appeared[bar][track])
-            {
-                emit_log(line, "Track %02d already defined previously, "
-                    "merging all notes", track);
-            }
-            track_appeared[bar][track] = true;
-
-            if (track == 2) {
-                // Time signature
-                errno = 0;
-                float x = strtof(s + 6, NULL);
-                if (errno != EINVAL && x >= 0.25 && x <= 63.75) {
-                    int y = (int)(x * 4 + 0.5);
-                    if (fabs(y - x * 4) >= 1e-3)
-                        emit_log(line, "Inaccurate time signature, treating as %d/4", y);
-                    if (chart->tracks.time_sig[bar] != 0)
-                        emit_log(line, "Time signature for bar %03d "
-                            "defined multiple times, overwriting", bar);
-                    chart->tracks.time_sig[bar] = y;
-                } else {
-                    emit_log(line, "Invalid time signature, should be a "
-                        "multiple of 0.25 between 0.25 and 63.75 (inclusive)");
-                }
-            } else if (track == 3) {
-                // Tempo change
-                parse_track(line, s + 6, &chart->tracks.tempo, bar);
-            } else if (track == 4) {
-                // BGA
-                parse_track(line, s + 6, &chart->tracks.bga_base, bar);
-            } else if (track == 6) {
-                // BGA poor
-                parse_track(line, s + 6, &chart->tracks.bga_poor, bar);
-            } else if (track == 7) {
-                // BGA layer
-                parse_track(line, s + 6, &chart->tracks.bga_layer, bar);
-            } else if (track == 8) {
-                // Extended tempo change
-                parse_track(line, s + 6, &chart->tracks.ex_tempo, bar);
-            } else if (track == 9) {
-                // Stop
-                parse_track(line, s + 6, &chart->tracks.stop, bar);
-            } else if (track >= 10 && track <= 69 && track % 10 != 0) {
-                // Fixed
-                parse_track(line, s + 6, &chart->tracks.object[track - 10], bar);
-            } else if (track == 1) {
-                if (bg_index[bar] == BM_BGM_TRACKS) {
-                    emit_log(line, "Too many background tracks (more than %d) "
-                        "for bar %03d, ignoring", BM_BGM_TRACKS, bar);
-                } else {
-                    parse_track(line, s + 6, &chart->tracks.background[bg_index[bar]], bar);
-                    bg_index[bar]++;
-                    if (chart->tracks.background_count < bg_index[bar])
-                        chart->tracks.background_count = bg_index[bar];
-                }
-            } else {
-                emit_log(line, "Unknown track %c%c, ignoring", s[3], s[4]);
-            }
-        } else {
-            // Command
-            int arg = 0;
-            while (arg < line_len && !isspace(s[arg])) arg++;
-            s[arg++] = '\0';
-            while (arg < line_len && isspace(s[arg])) arg++;
-
-            if (arg >= line_len) {
-                emit_log(line, "Command requires non-empty arguments, ignoring");
-                continue;
-            }
+static inline uint32_t breaks_bytewise(const char *p, size_t n)
+{
+    uint32_t mask = 0;
+    for (size_t i = 0; i < n; i++)
+        if (is_space_or_linebreak(p[i])) mask |= (uint32_t)1 << i;
+    return mask;
+}
 
-            #define checked_parse_int(_var, _min, _max, ...) do { \
-                errno = 0; \
-                long x = strtol(s + arg, NULL, 10); \
-                if (errno != EINVAL && x >= (_min) && x <= (_max)) { \
-                    if ((_var) != -1) emit_log(line, __VA_ARGS__); \
-                    (_var) = x; \
-                } else { \
-                    emit_log(line, "Invalid integral value, should be " \
-                        "between %d and %d (inclusive)", (_min) ,(_max)); \
-                } \
-            } while (0)
-
-            #define checked_parse_float(_var, _min, _max, ...) do { \
-                errno = 0; \
-                float x = strtof(s + arg, NULL); \
-                if (errno != EINVAL && x >= (_min) && x <= (_max)) { \
-                    if ((_var) != -1) emit_log(line, __VA_ARGS__); \
-                    (_var) = x; \
-                } else { \
-                    emit_log(line, "Invalid integral value, should be " \
-                        "between %g and %g (inclusive)", (_min) ,(_max)); \
-                } \
-            } while (0)
-
-            #define checked_strdup(_var, ...) do { \
-                char *x = strdup(s + arg); \
-                /* TODO: Handle cases of memory exhaustion? */ \
-                if (x != NULL) { \
-                    if ((_var) != NULL) { free(_var); emit_log(line, __VA_ARGS__); } \
-                    (_var) = x; \
-                } \
-            } while (0)
-
-            if (strcmp(s, "PLAYER") == 0) {
-                checked_parse_int(chart->meta.player_num,
-                    1, 3,
-                    "Multiple PLAYER commands, overwritten");
-            } else if (strcmp(s, "GENRE") == 0) {
-                checked_strdup(chart->meta.genre,
-                    "Multiple GENRE commands, overwritten");
-            } else if (strcmp(s, "TITLE") == 0) {
-                checked_strdup(chart->meta.title,
-                    "Multiple TITLE commands, overwritten");
-            } else if (strcmp(s, "ARTIST") == 0) {
-                checked_strdup(chart->meta.artist,
-                    "Multiple ARTIST commands, overwritten");
-            } else if (strcmp(s, "SUBARTIST") == 0) {
-                checked_strdup(chart->meta.subartist,
-                    "Multiple SUBARTIST commands, overwritten");
-            } else if (strcmp(s, "BPM") == 0) {
-                checked_parse_float(chart->meta.init_tempo,
-                    1.0, 999.0,
-                    "Multiple BPM commands, overwritten");
-            } else if (strcmp(s, "PLAYLEVEL") == 0) {
-                checked_parse_int(chart->meta.play_level,
-                    1, 999,
-                    "Multiple PLAYLEVEL commands, overwritten");
-            } else if (strcmp(s, "RANK") == 0) {
-                checked_parse_int(chart->meta.judge_rank,
-                    0, 3,
-                    "Multiple RANK commands, overwritten");
-            } else if (strcmp(s, "TOTAL") == 0) {
-                checked_parse_int(chart->meta.gauge_total,
-                    1, 9999,
-                    "Multiple TOTAL commands, overwritten");
-            } else if (strcmp(s, "DIFFICULTY") == 0) {
-                checked_parse_int(chart->meta.difficulty,
-                    1, 5,
-                    "Multiple DIFFICULTY commands, overwritten");
-            } else if (strcmp(s, "STAGEFILE") == 0) {
-                checked_strdup(chart->meta.stage_file,
-                    "Multiple STAGEFILE commands, overwritten");
-            } else if (strcmp(s, "BANNER") == 0) {
-                checked_strdup(chart->meta.banner,
-                    "Multiple BANNER commands, overwritten");
-            } else if (strcmp(s, "BACKBMP") == 0) {
-                checked_strdup(chart->meta.back_bmp,
-                    "Multiple BACKBMP commands, overwritten");
-            } else if (memcmp(s, "WAV", 3) == 0 && isbase36(s[3]) && isbase36(s[4])) {
-                int index = base36(s[3], s[4]);
-                checked_strdup(chart->tables.wav[index],
-                    "Wave %c%c specified multiple times, overwritten", s[3], s[4]);
-            } else if (memcmp(s, "BMP", 3) == 0 && isbase36(s[3]) && isbase36(s[4])) {
-                int index = base36(s[3], s[4]);
-                checked_strdup(chart->tables.bmp[index],
-                    "Bitmap %c%c specified multiple times, overwritten", s[3], s[4]);
-            } else if (memcmp(s, "BPM", 3) == 0 && isbase36(s[3]) && isbase36(s[4])) {
-                int index = base36(s[3], s[4]);
-                checked_parse_float(chart->tables.tempo[index],
-                    1.0, 999.0,
-                    "Tempo %c%c specified multiple times, overwritten", s[3], s[4]);
-            } else if (memcmp(s, "STOP", 4) == 0 && isbase36(s[4]) && isbase36(s[5])) {
-                int index = base36(s[4], s[5]);
-                checked_parse_int(chart->tables.stop[index],
-                    0, 32767,
-                    "Stop %c%c specified multiple times, overwritten", s[4], s[5]);
-            } else if (strcmp(s, "LNOBJ") == 0) {
-                if (isbase36(s[arg]) && isbase36(s[arg + 1])) {
-                    if (lnobj != -1)
-                        emit_log(line, "Multiple LNOBJ commands, overwritten");
-                    lnobj = base36(s[arg], s[arg + 1]);
-                } else {
-                    emit_log(line, "Invalid base-36 index %c%c, ignoring",
-                        s[arg], s[arg + 1]);
-                }
-            } else {
-                emit_log(line, "Unrecognized command %s, ignoring", s);
-            }
-        }
-    }
+#ifdef BM_SSE2
+static inline uint32_t breaks_sse2(const char *p)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i nul = _mm_setzero_si128();
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+    a = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(a, cr), _mm_cmpeq_epi8(a, lf)),
+        _mm_cmpeq_epi8(a, nul));
+    b = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, cr), _mm_cmpeq_epi8(b, lf)),
+        _mm_cmpeq_epi8(b, nul));
+    return (uint32_t)_mm_movemask_epi8(a) | ((uint32_t)_mm_movemask_epi8(b) << 16);
+}
+#endif
 
-    // Postprocessing
+#ifdef BM_AVX2
+__attribute__((target("avx2")))
+static uint32_t breaks_avx2(const char *p)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i nul = _mm256_setzero_si256();
+    __m256i a = _mm256_loadu_si256((const __m256i *)p);
+    a = _mm256_or_si256(_mm256_or_si256(
+        _mm256_cmpeq_epi8(a, cr), _mm256_cmpeq_epi8(a, lf)),
+        _mm256_cmpeq_epi8(a, nul));
+    return (uint32_t)_mm256_movemask_epi8(a);
+}
+#endif
 
-    // Reinterpret base-36 as base-16
-    for (int i = 0; i < chart->tracks.tempo.note_count; i++) {
-        int x = chart->tracks.tempo.notes[i].value;
-        chart->tracks.tempo.notes[i].value = (x / 36) * 16 + (x % 36);
+static inline uint32_t block_breaks(const struct line_scanner *sc, size_t block)
+{
+    const char *p = sc->src + block;
+    if (sc->len - block < SCAN_BLOCK) return breaks_bytewise(p, sc->len - block);
+    switch (sc->mode) {
+#ifdef BM_AVX2
+    case SCAN_AVX2: return breaks_avx2(p);
+#endif
+#ifdef BM_SSE2
+    case SCAN_SSE2: return breaks_sse2(p);
+#endif
+    default: return breaks_bytewise(p, SCAN_BLOCK);
     }
+}
 
-    // Sort notes and handle coincident overwrites
-    // Also keep track of the maximum bar number
-    int max_bars = 0;
-    for (int i = 0; i < 60; i++) sort_track(&chart->tracks.object[i], &max_bars);
-    sort_track(&chart->tracks.tempo, &max_bars);
-    sort_track(&chart->tracks.bga_base, &max_bars);
-    sort_track(&chart->tracks.bga_layer, &max_bars);
-    sort_track(&chart->tracks.bga_poor, &max_bars);
-    sort_track(&chart->tracks.ex_tempo, &max_bars);
-    sort_track(&chart->tracks.stop, &max_bars);
+static void init_scanner(struct line_scanner *sc,
+    const char *src, size_t len, bool vectorized)
+{
+    sc->src = src;
+    sc->len = len;
+    sc->pos = 0;
+    sc->line = 1;
+    sc->mode = SCAN_SCALAR;
+    if (vectorized) {
+        sc->mode = SCAN_SWAR;
+    #ifdef BM_SSE2
+        sc->mode = SCAN_SSE2;
+    #endif
+    #ifdef BM_AVX2
+        if (__builtin_cpu_supports("avx2")) sc->mode = SCAN_AVX2;
+    #endif
+    }
+    sc->block = 0;
+    sc->mask = block_breaks(sc, 0);
+}
 
-    // Handle long notes
-    // NOTE: #LNTYPE is not supported and is object to LNTYPE 1
-    for (int i = 0; i < 20; i++)    // Indices 11-29
-        for (int j = 1; j < chart->tracks.object[i].note_count; j++) {
-            if (chart->tracks.object[i].notes[j].value == lnobj &&
-                chart->tracks.object[i].notes[j - 1].value != -1)
-            {
-                chart->tracks.object[i].notes[j].value = -1;
-                chart->tracks.object[i].notes[j - 1].hold = true;
-                j++;
-            }
-        }
-    for (int i = 40; i < 60; i++)   // Indices 51-69
-        for (int j = 1; j < chart->tracks.object[i].note_count; j++) {
-            if (chart->tracks.object[i].notes[j].value ==
-                chart->tracks.object[i].notes[j - 1].value)
-            {
-                chart->tracks.object[i].notes[j].value = -1;
-                chart->tracks.object[i].notes[j - 1].hold = true;
-                j++;
-            }
+// Returns the position of the first line break at or after `from`,
+// or the length of the source if there is none
+static inline size_t next_break(struct line_scanner *sc, size_t from)
+{
+    if (sc->mode == SCAN_SCALAR) {
+        while (from < sc->len && !is_space_or_linebreak(sc->src[from])) from++;
+        return from;
+    }
+
+    while (true) {
+        while (sc->mask == 0) {
+            sc->block += SCAN_BLOCK;
+            if (sc->block >= sc->len) return sc->len;
+            sc->mask = block_breaks(sc, sc->block);
         }
+        size_t pos = sc->block + ctz32(sc->mask);
+        sc->mask &= sc->mask - 1;
+        if (pos >= from) return pos;
+    }
+}
 
-    // Fill in missing time signatures
-    for (int i = 0; i <= max_bars; i++)
-        if (chart->tracks.time_sig[i] == 0)
-            chart->tracks.time_sig[i] = 4;
+// Checks for "dddDD:" after the # character
+// `avail` is the number of bytes that can be read from `s`
+static inline bool is_track_line(const char *s, int len, size_t avail)
+{
+    if (len < 6) return false;
+#ifdef BM_LITTLE_ENDIAN
+    if (avail >= 8) {
+        uint64_t x;
+        memcpy(&x, s, 8);
+        // Digits become 0x00-0x09 in the first five bytes
+        uint64_t t = (x & 0xffffffffffull) ^ 0x3030303030ull;
+        return ((t | (t + 0x0606060606ull)) & 0xf0f0f0f0f0ull) == 0 &&
+            ((x >> 40) & 0xff) == ':';
+    }
+#endif
+    return is_digit(s[0]) && is_digit(s[1]) && is_digit(s[2]) &&
+        is_digit(s[3]) && is_digit(s[4]) && s[5] == ':';
+}
 
-    #define check_default(_var, _name, _initial, _val) do { \
-        if ((_var) == (_initial)) { \
-            emit_log(-1, "Command " _name " did not appear, defaulting to " #_val); \
-            (_var) = (_val); \
-        } \
-    } while (0)
+// Collects up to `max` lines that start with # after trimming
+// Returns 0 at the end of the source
+static int scan_lines(struct line_scanner *sc, struct line_entry *out, int max)
+{
+    const char *src = sc->src;
+    int n = 0;
 
-    #define check_default_no_log(_var, _name, _initial, _val) do { \
-        if ((_var) == (_initial)) (_var) = (_val); \
-    } while (0)
+    while (n < max && sc->pos < sc->len) {
+        size_t start = sc->pos;
+        size_t end = next_break(sc, start);
+        sc->pos = end + 1;
+        if (end + 1 < sc->len && src[end] == '\r' && src[end + 1] == '\n') sc->pos++;
+        int line = sc->line++;
 
-    check_default(chart->meta.player_num, "PLAYER", -1, 1);
-    check_default(chart->meta.genre, "GENRE", NULL, strdup("(unknown)"));
-    check_default(chart->meta.title, "TITLE", NULL, strdup("(unknown)"));
-    check_default(chart->meta.artist, "ARTIST", NULL, strdup("(unknown)"));
-    check_default_no_log(chart->meta.subartist, "SUBARTIST", NULL, strdup("(unknown)"));
-    check_default(chart->meta.init_tempo, "BPM", -1, 130);
-    check_default(chart->meta.play_level, "LEVEL", -1, 3);
-    check_default_no_log(chart->meta.judge_rank, "RANK", -1, 3);
-    check_default_no_log(chart->meta.gauge_total, "TOTAL", -1, 160);
-    check_default_no_log(chart->meta.stage_file, "STAGEFILE", NULL, strdup("(none)"));
-    check_default_no_log(chart->meta.banner, "BANNER", NULL, strdup("(none)"));
-    check_default_no_log(chart->meta.back_bmp, "BACKBMP", NULL, strdup("(none)"));
+        // Trim at both ends; comments are skipped
+        while (start < end && is_blank(src[start])) start++;
+        if (start == end || src[start] != '#') continue;
+        while (is_blank(src[end - 1])) end--;
+
+        out[n].start = start + 1;
+        out[n].len = end - start - 1;
+        out[n].line = line;
+        n++;
+    }
+
+    for (int i = 0; i < n; i++)
+        out[i].is_track = is_track_line(src + out[i].start, out[i].len,
+            sc->len - out[i].start);
 
-    free(source);
-    return log_ptr;
+    return n;
 }
 
-static inline void add_event_arr(
-    struct bm_event **arr, struct bm_event *event, int *size, int *cap)
+static inline int isbase36(char ch)
 {
-    // XXX: More DRY
-    if (*cap <= *size) {
-        *cap = (*cap == 0 ? 8 : (*cap << 1));
-        *arr = (struct bm_event *)
-            realloc(*arr, (*cap) * sizeof(struct bm_event));
-    }
-    (*arr)[(*size)++] = *event;
+    return (ch >= '0' && ch <= '9') || (ch >= 'A' && ch <= 'Z');
 }
 
-static inline int event_pos_type_compare(const void *_lhs, const void *_rhs)
+static inline int base36(char c1, char c2)
 {
-    struct bm_event *lhs = (struct bm_event *)_lhs;
-    struct bm_event *rhs = (struct bm_event *)_rhs;
-    int diff = lhs->pos - rhs->pos;
-    return (diff == 0 ?  lhs->type - rhs->type : diff);
+    // Assumes isbase36(c1) and isbase36(c2) are true
+    return
+        (c1 <= '9' ? c1 - '0' : c1 - 'A' + 10) * 36 +
+        (c2 <= '9' ? c2 - '0' : c2 - 'A' + 10);
 }
 
-void bm_to_seq(struct bm_chart *chart, struct bm_seq *seq)
+// Copies a span into a NUL-terminated buffer for the strto* family
+static inline const char *span_str(char *buf, int size, const char *s, int len)
 {
-    memset(seq, 0, sizeof(struct bm_seq));
+    if (len >= size) len = size - 1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    return buf;
+}
 
-    int cap = 0;
-    int bar_start[BM_BARS_COUNT];
-    struct bm_event event;
+// Arena allocation
+// Every string and note array of a chart is carved out of a list of
+// blocks, which is usually a single block sized by a counting pass
 
-    #define add_event() add_event_arr(&seq->events, &event, &seq->event_count, &cap)
+struct bm_arena {
+    struct bm_arena *next;
+    const struct bm_allocator *alloc;
+    size_t size, used;
+    // A compiled chart file, mapped or read into memory, owned by the block
+    char *file;
+    size_t file_len;
+    bool file_mapped;
+};
 
-    // Bar lines
-    for (int i = 0, beats = 0; i < BM_BARS_COUNT; i++) {
-        bar_start[i] = beats;
-        event.pos = beats * 48;
-        event.type = BM_BARLINE;
-        event.track = 0;
-        event.value = i;
-        event.value_a = chart->tracks.time_sig[i];
-        beats += chart->tracks.time_sig[i];
-        add_event();
-        if (chart->tracks.time_sig[i] == 0) break;
-    }
-
-    struct bm_note *note;
-
-    #define track_each(_track) \
-        (int j = 0; j < (_track).note_count && (note = (_track).notes + j); j++)
-    #define pos(_note) (bar_start[(_note)->bar] * 48 + \
-        (int)((_note)->beat * chart->tracks.time_sig[(_note)->bar] * 48))
-
-    // Tempo changes
-    // Track 03
-    for track_each(chart->tracks.tempo) {
-        event.pos = pos(note);
-        event.type = BM_TEMPO_CHANGE;
-        event.track = 3;
-        event.value_f = note->value;
-        add_event();
-    }
-    // Track 08
-    for track_each(chart->tracks.ex_tempo) {
-        event.pos = pos(note);
-        event.type = BM_TEMPO_CHANGE;
-        event.track = 8;
-        event.value_f = chart->tables.tempo[note->value];
-        add_event();
-    }
-
-    // BGA changes
-    // Track 04: base
-    for track_each(chart->tracks.bga_base) {
-        event.pos = pos(note);
-        event.type = BM_BGA_BASE_CHANGE;
-        event.track = 4;
-        event.value = note->value;
-        add_event();
-    }
-    // Track 07: layer
-    for track_each(chart->tracks.bga_layer) {
-        event.pos = pos(note);
-        event.type = BM_BGA_LAYER_CHANGE;
-        event.track = 7;
-        event.value = note->value;
-        add_event();
-    }
-    // Track 06: poor
-    for track_each(chart->tracks.bga_poor) {
-        event.pos = pos(note);
-        event.type = BM_BGA_POOR_CHANGE;
-        event.track = 6;
-        event.value = note->value;
-        add_event();
-    }
-
-    // Stops
-    for track_each(chart->tracks.stop) {
-        event.pos = pos(note);
-        event.type = BM_STOP;
-        event.track = 9;
-        event.value = chart->tables.stop[note->value];
-        add_event();
-    }
-
-    // Object tracks
-    // Backgrounds
-    for (int i = 0; i < chart->tracks.background_count; i++)
-        for track_each(chart->tracks.background[i]) {
-            // No long notes in background tracks
-            event.pos = pos(note);
-            event.type = BM_NOTE;
-            event.track = -i;
-            event.value = note->value;
-            add_event();
-        }
+#define ARENA_ALIGN         8
+#define ARENA_MIN_BLOCK     4096
+#define ARENA_HEADER        \
+    ((sizeof(struct bm_arena) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define arena_data(_a)      ((char *)(_a) + ARENA_HEADER)
 
-    // Objects
-    for (int i = 0; i < 60; i++)
-        for track_each(chart->tracks.object[i]) {
-            if (note->value == -1) {
-                // Release of a long note
-                event.type = BM_NOTE_LONG;
-                event.value_a = pos(note) - event.pos;
-                add_event();
-                // Add a pair of events to simplify time-range queries
-                event.pos = pos(note);
-                event.type = BM_NOTE_OFF;
-                add_event();
-            } else {
-                event.pos = pos(note);
-                event.track = i + 10;
-                if (event.track >= 50) event.track -= 40;
-                event.value = note->value;
-                if (!note->hold) {
-                    // Normal note
-                    event.type = BM_NOTE;
-                    add_event();
-                }
-            }
-        }
+static bool arena_add_block(const struct bm_allocator *alloc,
+    struct bm_arena **arena, size_t size)
+{
+    struct bm_arena *a = (struct bm_arena *)mem_alloc(alloc, ARENA_HEADER + size);
+    if (a == NULL) return false;
+    a->next = *arena;
+    a->alloc = alloc;
+    a->size = size;
+    a->used = 0;
+    a->file = NULL;
+    a->file_len = 0;
+    a->file_mapped = false;
+    *arena = a;
+    return true;
+}
 
-    // With a stable sorting algorithm only positions need to be compared
-    qsort(seq->events, seq->event_count,
-        sizeof(struct bm_event), event_pos_type_compare);
+// Further blocks come from the allocator of the first one,
+// which is added by the loader
+static void *arena_alloc(struct bm_arena **arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct bm_arena *a = *arena;
+    if (a == NULL) return NULL;
+    if (a->size - a->used < size) {
+        size_t block = a->size * 2;
+        if (block < size) block = size;
+        if (!arena_add_block(a->alloc, arena, block)) return NULL;
+        a = *arena;
+    }
+    void *p = arena_data(a) + a->used;
+    a->used += size;
+    return p;
+}
 
-    // Collect long notes
-    cap = 0;
-    for (int i = 0; i < seq->event_count; i++)
-        if (seq->events[i].type == BM_NOTE_LONG) {
-            add_event_arr(&seq->long_notes, &seq->events[i],
-                &seq->long_note_count, &cap);
+static void free_arena(struct bm_arena *arena)
+{
+    while (arena != NULL) {
+        struct bm_arena *next = arena->next;
+        if (arena->file != NULL) {
+        #ifndef _WIN32
+            if (arena->file_mapped) munmap(arena->file, arena->file_len);
+            else
+        #endif
+            mem_free(arena->alloc, arena->file);
         }
+        mem_free(arena->alloc, arena);
+        arena = next;
+    }
 }
 
-#define sfree(_p) (((_p) != NULL) && (free(_p), (_p) = NULL))
+static inline char *span_dup(struct bm_arena **arena, const char *s, int len)
+{
+    char *x = (char *)arena_alloc(arena, len + 1);
+    if (x != NULL) {
+        memcpy(x, s, len);
+        x[len] = '\0';
+    }
+    return x;
+}
 
-void bm_close_chart(struct bm_chart *chart)
+// Allocates the capacity found by the counting pass
+static inline void reserve_notes(struct bm_arena **arena, struct bm_track *track)
 {
-    sfree(chart->meta.genre);
-    sfree(chart->meta.title);
-    sfree(chart->meta.artist);
-    sfree(chart->meta.subartist);
-    sfree(chart->meta.stage_file);
-    sfree(chart->meta.banner);
-    sfree(chart->meta.back_bmp);
-    for (int i = 0; i < BM_INDEX_MAX; i++) sfree(chart->tables.wav[i]);
-    for (int i = 0; i < BM_INDEX_MAX; i++) sfree(chart->tables.bmp[i]);
-    for (int i = 0; i < chart->tracks.background_count; i++)
-        sfree(chart->tracks.background[i].notes);
-    for (int i = 0; i < 60; i++)
-        sfree(chart->tracks.object[i].notes);
-    sfree(chart->tracks.tempo.notes);
-    sfree(chart->tracks.bga_base.notes);
-    sfree(chart->tracks.bga_layer.notes);
-    sfree(chart->tracks.bga_poor.notes);
-    sfree(chart->tracks.ex_tempo.notes);
-    sfree(chart->tracks.stop.notes);
+    if (track->note_cap > 0)
+        track->notes = (struct bm_note *)
+            arena_alloc(arena, track->note_cap * sizeof(struct bm_note));
+    if (track->notes == NULL) track->note_cap = 0;
 }
 
-void bm_close_seq(struct bm_seq *seq)
+// Makes room for `count` more notes; false if out of memory
+static inline bool grow_notes(struct bm_arena **arena, struct bm_track *track, int count)
+{
+    if (track->note_cap - track->note_count >= count) return true;
+    // Only reached without a counting pass; the old array is abandoned
+    int cap = (track->note_cap == 0 ? 8 : (track->note_cap << 1));
+    while (cap - track->note_count < count) cap <<= 1;
+    struct bm_note *notes = (struct bm_note *)
+        arena_alloc(arena, cap * sizeof(struct bm_note));
+    if (notes == NULL) return false;
+    if (track->note_count > 0)
+        memcpy(notes, track->notes, track->note_count * sizeof(struct bm_note));
+    track->notes = notes;
+    track->note_cap = cap;
+    return true;
+}
+
+// The note lies `num` out of `den` divisions into the bar
+static inline void set_note(struct bm_note *note, short bar, int num, int den, short value)
+{
+    note->bar = bar;
+    note->hold = false;
+    note->beat = (float)num / den;
+    note->num = num;
+    note->den = den;
+    note->value = value;
+}
+
+static inline void add_note(struct bm_arena **arena,
+    struct bm_track *track, short bar, int num, int den, short value)
+{
+    if (!grow_notes(arena, track, 1)) return;
+    set_note(&track->notes[track->note_count++], bar, num, den, value);
+}
+
+// Appends notes decoded beforehand
+static inline void add_notes(struct bm_arena **arena,
+    struct bm_track *track, const struct bm_note *notes, int count)
+{
+    if (count == 0 || !grow_notes(arena, track, count)) return;
+    memcpy(track->notes + track->note_count, notes, count * sizeof(struct bm_note));
+    track->note_count += count;
+}
+
+// What the loader has seen of one bar
+struct bar_state {
+    uint64_t appeared[2];   // Bit per channel (00-99) with a line
+    int bg_counted;         // Background lines in the counting pass
+    int bg_loaded;          // Background lines parsed so far
+};
+
+// State of one bm_load_ctx() call, shared by all lines
+struct loader {
+    struct bm_parse_ctx *ctx;
+    struct bm_chart *chart;
+    int flags;
+    int lnobj;
+    int bar_cap;            // Bars up to the highest one seen so far
+    struct bar_state *bars;
+    int bg_cap;             // Capacity of chart->tracks.background
+    int log_limit;          // Of the context, restored at the end
+};
+
+// Makes the state of `bar` available; false if out of memory
+static bool reach_bar(struct loader *ld, int bar)
 {
-    sfree(seq->events);
-    sfree(seq->long_notes);
+    if (bar < ld->bar_cap) return true;
+    int cap = (ld->bar_cap == 0 ? 64 : ld->bar_cap);
+    while (cap <= bar) cap <<= 1;
+    if (cap > BM_BARS_COUNT) cap = BM_BARS_COUNT;
+    struct bar_state *bars = (struct bar_state *)mem_realloc(
+        get_allocator(ld->ctx->alloc), ld->bars, cap * sizeof(struct bar_state));
+    if (bars == NULL) return false;
+    memset(bars + ld->bar_cap, 0, (cap - ld->bar_cap) * sizeof(struct bar_state));
+    ld->bars = bars;
+    ld->bar_cap = cap;
+    return true;
+}
+
+// Makes background track `index` available, growing the array in the
+// arena (only without a counting pass); NULL if out of memory
+static struct bm_track *reach_background(struct loader *ld, int index)
+{
+    struct bm_tracks *tracks = &ld->chart->tracks;
+    if (index >= ld->bg_cap) {
+        int cap = (ld->bg_cap == 0 ? 8 : ld->bg_cap);
+        while (cap <= index) cap <<= 1;
+        struct bm_track *background = (struct bm_track *)
+            arena_alloc(&ld->chart->arena, cap * sizeof(struct bm_track));
+        if (background == NULL) return NULL;
+        if (ld->bg_cap > 0)
+            memcpy(background, tracks->background, ld->bg_cap * sizeof(struct bm_track));
+        memset(background + ld->bg_cap, 0, (cap - ld->bg_cap) * sizeof(struct bm_track));
+        tracks->background = background;
+        ld->bg_cap = cap;
+    }
+    return &tracks->background[index];
+}
+
+// Receives entry `i` out of `count` of a track line, if non-zero
+typedef void (*pair_fn)(void *user, int i, int count, int value);
+
+#ifdef BM_SSE2
+// Decodes pairs from a line of even length that consists only of
+// base-36 digits, 16 pairs at a time
+// Returns false without reporting any pair otherwise
+static inline bool decode_pairs_sse2(const char *s, int len, pair_fn fn, void *user)
+{
+    const __m128i lt_0 = _mm_set1_epi8('0' - 1), gt_9 = _mm_set1_epi8('9' + 1);
+    const __m128i lt_A = _mm_set1_epi8('A' - 1), gt_Z = _mm_set1_epi8('Z' + 1);
+    const __m128i zero = _mm_setzero_si128();
+
+    int count = len / 2;
+    int p, i;
+
+    #define valid16(_c) _mm_movemask_epi8(_mm_or_si128( \
+        _mm_and_si128(_mm_cmpgt_epi8(_c, lt_0), _mm_cmplt_epi8(_c, gt_9)), \
+        _mm_and_si128(_mm_cmpgt_epi8(_c, lt_A), _mm_cmplt_epi8(_c, gt_Z))))
+
+    #define decode16(_c, _v) do { \
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(_c, lt_A), _mm_cmplt_epi8(_c, gt_Z)); \
+        /* Digit values; letters are 7 further from '0' than they should be */ \
+        __m128i d = _mm_sub_epi8(_mm_sub_epi8(_c, _mm_set1_epi8('0')), \
+            _mm_and_si128(alpha, _mm_set1_epi8(7))); \
+        /* Each 16-bit lane holds a pair, with the leading digit in the low byte */ \
+        (_v) = _mm_add_epi16( \
+            _mm_mullo_epi16(_mm_and_si128(d, _mm_set1_epi16(0xff)), _mm_set1_epi16(36)), \
+            _mm_srli_epi16(d, 8)); \
+    } while (0)
+
+    // Validated in full first, so that nothing is reported for invalid lines
+    for (p = 0; p + 16 <= len; p += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + p));
+        if (valid16(c) != 0xffff) return false;
+    }
+    for (; p < len; p++)
+        if (!isbase36(s[p])) return false;
+
+    for (p = 0, i = 0; p + 32 <= len; p += 32, i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + p));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + p + 16));
+        __m128i va, vb;
+        decode16(a, va);
+        decode16(b, vb);
+
+        // One mask bit per non-zero pair
+        unsigned nonzero = ~_mm_movemask_epi8(_mm_packs_epi16(
+            _mm_cmpeq_epi16(va, zero), _mm_cmpeq_epi16(vb, zero))) & 0xffff;
+        if (nonzero == 0) continue;
+
+        short values[16];
+        _mm_storeu_si128((__m128i *)values, va);
+        _mm_storeu_si128((__m128i *)(values + 8), vb);
+        for (; nonzero != 0; nonzero &= nonzero - 1) {
+            int k = ctz32(nonzero);
+            fn(user, i + k, count, values[k]);
+        }
+    }
+
+    #undef valid16
+    #undef decode16
+
+    for (; p < len; p += 2, i++) {
+        int value = base36(s[p], s[p + 1]);
+        if (value != 0) fn(user, i, count, value);
+    }
+
+    return true;
+}
+#endif
+
+// Decodes the data of a track line, reporting syntax errors to `ctx`
+// Shared by the loader and the callback parser; `fn` is a known function
+// wherever this is inlined, so the calls are direct
+static inline void decode_pairs(struct bm_parse_ctx *ctx, int line,
+    const char *s, int len, int flags, pair_fn fn, void *user)
+{
+    // Positions are stored as fractions with 16-bit denominators
+    if (len > BM_MAX_DIVISIONS * 2 + 1) {
+        int count = 0;
+        for (int p = 0; p < len; p++) count += (!is_blank(s[p]));
+        if (count / 2 > BM_MAX_DIVISIONS) {
+            emit_log_int(line, BM_LOG_TOO_MANY_ENTRIES, BM_MAX_DIVISIONS);
+            return;
+        }
+    }
+
+#ifdef BM_SSE2
+    // Lines with blanks or invalid characters take the path below,
+    // which also produces the diagnostics
+    if (!(flags & BM_LOAD_SCALAR) && decode_pairs_sse2(s, len & ~1, fn, user)) {
+        if (len & 1)
+            emit_log_text(line, BM_LOG_TRAILING_CHAR, s + len - 1, 1);
+        return;
+    }
+#else
+    (void)flags;
+#endif
+
+    int count = 0;
+    for (int p = 0; p < len; p++) count += (!is_blank(s[p]));
+    count /= 2;
+
+    for (int p = 0, q, i = 0; p < len; p = q + 1) {
+        while (p < len && is_blank(s[p])) p++;
+        if (p >= len) break;
+        q = p + 1;
+        while (q < len && is_blank(s[q])) q++;
+        if (q >= len) {
+            emit_log_text(line, BM_LOG_TRAILING_CHAR, s + p, 1);
+            break;
+        }
+        if (!isbase36(s[p]) || !isbase36(s[q])) {
+            char pair[2] = { s[p], s[q] };
+            emit_log(line, BM_LOG_INVALID_PAIR, p + 8, 0, pair, 2);
+            continue;
+        }
+        int value = base36(s[p], s[q]);
+        if (value != 0) fn(user, i, count, value);
+        i++;
+    }
+}
+
+struct track_sink {
+    struct bm_arena **arena;
+    struct bm_track *track;
+    short bar;
+};
+
+static void add_track_note(void *user, int i, int count, int value)
+{
+    struct track_sink *t = (struct track_sink *)user;
+    add_note(t->arena, t->track, t->bar, i, count, value);
+}
+
+static inline void parse_track(struct loader *ld, int line, const char *s, int len,
+    struct bm_track *track, short bar)
+{
+    struct track_sink sink = { &ld->chart->arena, track, bar };
+    decode_pairs(ld->ctx, line, s, len, ld->flags, add_track_note, &sink);
+}
+
+// Notes compare exactly by cross-multiplying their fractions of the bar
+static inline bool note_before(const struct bm_note *lhs, const struct bm_note *rhs)
+{
+    if (lhs->bar != rhs->bar) return lhs->bar < rhs->bar;
+    return (uint32_t)lhs->num * rhs->den < (uint32_t)rhs->num * lhs->den;
+}
+
+static inline bool note_same(const struct bm_note *lhs, const struct bm_note *rhs)
+{
+    return lhs->bar == rhs->bar &&
+        (uint32_t)lhs->num * rhs->den == (uint32_t)rhs->num * lhs->den;
+}
+
+// Merges the runs [lo, mid) and [mid, hi) of `src` into `dst`,
+// taking from the left run on ties
+static inline void merge_runs(const struct bm_note *src, struct bm_note *dst,
+    int lo, int mid, int hi)
+{
+    int i = lo, j = mid, k = lo;
+    while (i < mid && j < hi)
+        dst[k++] = (note_before(&src[j], &src[i]) ? src[j++] : src[i++]);
+    while (i < mid) dst[k++] = src[i++];
+    while (j < hi) dst[k++] = src[j++];
+}
+
+static inline int run_end(const struct bm_note *notes, int lo, int n)
+{
+    while (++lo < n && !note_before(&notes[lo], &notes[lo - 1])) { }
+    return lo;
+}
+
+// Natural merge sort: notes mostly arrive as a few sorted runs (one per
+// line, usually in bar order), which are merged pairwise until one is left
+// Stable; linear for sorted input, which needs no scratch memory
+static void sort_notes(struct bm_note *notes, int n, struct bm_note **scratch,
+    int *scratch_cap, const struct bm_allocator *alloc)
+{
+    if (n < 2 || run_end(notes, 0, n) == n) return;
+
+    if (*scratch_cap < n) {
+        mem_free(alloc, *scratch);
+        *scratch = (struct bm_note *)mem_alloc(alloc, n * sizeof(struct bm_note));
+        *scratch_cap = (*scratch != NULL ? n : 0);
+    }
+    if (*scratch == NULL) {
+        // Out of memory; insertion sort is also stable
+        for (int i = 1; i < n; i++) {
+            struct bm_note x = notes[i];
+            int j = i;
+            for (; j > 0 && note_before(&x, &notes[j - 1]); j--)
+                notes[j] = notes[j - 1];
+            notes[j] = x;
+        }
+        return;
+    }
+
+    struct bm_note *src = notes, *dst = *scratch;
+    bool merged;
+    do {
+        merged = false;
+        for (int lo = 0; lo < n; ) {
+            int mid = run_end(src, lo, n);
+            int hi = (mid < n ? run_end(src, mid, n) : n);
+            merge_runs(src, dst, lo, mid, hi);
+            merged |= (mid < n);
+            lo = hi;
+        }
+        struct bm_note *t = src; src = dst; dst = t;
+    } while (merged);
+    if (src != notes) memcpy(notes, src, n * sizeof(struct bm_note));
+}
+
+static inline void sort_track(struct bm_track *track, int *max_bars,
+    struct bm_note **scratch, int *scratch_cap, const struct bm_allocator *alloc)
+{
+    // A stable sorting algorithm
+    sort_notes(track->notes, track->note_count, scratch, scratch_cap, alloc);
+    // Remove duplicates; the note that appears last wins
+    int p, q;
+    for (p = 0, q = -1; p < track->note_count; p++) {
+        if (q == -1 || !note_same(&track->notes[q], &track->notes[p])) q++;
+        if (p != q) track->notes[q] = track->notes[p];
+    }
+    track->note_count = q + 1;
+
+    // Update maximum bar number
+    if (track->note_count > 0 &&
+        *max_bars < track->notes[track->note_count - 1].bar)
+    {
+        *max_bars = track->notes[track->note_count - 1].bar;
+    }
+}
+
+static inline bool meta_complete(const struct bm_metadata *meta)
+{
+    return meta->player_num != -1 && meta->genre != NULL &&
+        meta->title != NULL && meta->artist != NULL &&
+        meta->subartist != NULL && meta->init_tempo != -1 &&
+        meta->play_level != -1 && meta->judge_rank != -1 &&
+        meta->gauge_total != -1 && meta->difficulty != -1 &&
+        meta->stage_file != NULL && meta->banner != NULL &&
+        meta->back_bmp != NULL;
+}
+
+// Postprocessing of track data
+static void finish_tracks(struct bm_chart *chart, int lnobj)
+{
+    // Reinterpret base-36 as base-16
+    for (int i = 0; i < chart->tracks.tempo.note_count; i++) {
+        int x = chart->tracks.tempo.notes[i].value;
+        chart->tracks.tempo.notes[i].value = (x / 36) * 16 + (x % 36);
+    }
+
+    // Sort notes and handle coincident overwrites
+    // Also keep track of the maximum bar number
+    int max_bars = 0;
+    const struct bm_allocator *alloc =
+        (chart->arena != NULL ? chart->arena->alloc : default_allocator);
+    struct bm_note *scratch = NULL;
+    int scratch_cap = 0;
+    #define sort(_track) sort_track(&(_track), &max_bars, &scratch, &scratch_cap, alloc)
+    for (int i = 0; i < chart->tracks.background_count; i++)
+        sort(chart->tracks.background[i]);
+    for (int i = 0; i < 60; i++) sort(chart->tracks.object[i]);
+    sort(chart->tracks.tempo);
+    sort(chart->tracks.bga_base);
+    sort(chart->tracks.bga_layer);
+    sort(chart->tracks.bga_poor);
+    sort(chart->tracks.ex_tempo);
+    sort(chart->tracks.stop);
+    #undef sort
+    mem_free(alloc, scratch);
+
+    // Handle long notes
+    // NOTE: #LNTYPE is not supported and is object to LNTYPE 1
+    for (int i = 0; i < 20; i++)    // Indices 11-29
+        for (int j = 1; j < chart->tracks.object[i].note_count; j++) {
+            if (chart->tracks.object[i].notes[j].value == lnobj &&
+                chart->tracks.object[i].notes[j - 1].value != -1)
+            {
+                chart->tracks.object[i].notes[j].value = -1;
+                chart->tracks.object[i].notes[j - 1].hold = true;
+                j++;
+            }
+        }
+    for (int i = 40; i < 60; i++)   // Indices 51-69
+        for (int j = 1; j < chart->tracks.object[i].note_count; j++) {
+            if (chart->tracks.object[i].notes[j].value ==
+                chart->tracks.object[i].notes[j - 1].value)
+            {
+                chart->tracks.object[i].notes[j].value = -1;
+                chart->tracks.object[i].notes[j - 1].hold = true;
+                j++;
+            }
+        }
+
+    // Fill in missing time signatures
+    for (int i = 0; i <= max_bars; i++)
+        if (chart->tracks.time_sig[i] == 0)
+            chart->tracks.time_sig[i] = 4;
+}
+
+// The track that notes of a channel go into, except for backgrounds (01)
+// and time signatures (02); NULL for unknown channels
+static inline struct bm_track *fixed_track(struct bm_tracks *tracks, int track)
+{
+    switch (track) {
+    case 3: return &tracks->tempo;      // Tempo change
+    case 4: return &tracks->bga_base;   // BGA
+    case 6: return &tracks->bga_poor;   // BGA poor
+    case 7: return &tracks->bga_layer;  // BGA layer
+    case 8: return &tracks->ex_tempo;   // Extended tempo change
+    case 9: return &tracks->stop;       // Stop
+    default:
+        // Fixed
+        if (track >= 10 && track <= 69 && track % 10 != 0)
+            return &tracks->object[track - 10];
+        return NULL;
+    }
+}
+
+// Whether fixed_track() gives a track for the channel
+static inline bool is_fixed_track(int track)
+{
+    return (track >= 3 && track <= 9 && track != 5) ||
+        (track >= 10 && track <= 69 && track % 10 != 0);
+}
+
+// Number of notes a track line can add at most; exact for lines without blanks
+static inline int count_notes(const char *s, int len)
+{
+    int blanks = 0, zeros = 0;
+    for (int p = 0; p < len; p++) blanks += is_blank(s[p]);
+    if (blanks > 0) return (len - blanks) / 2;
+    for (int p = 0; p + 1 < len; p += 2) zeros += (s[p] == '0' && s[p + 1] == '0');
+    return len / 2 - zeros;
+}
+
+// Counting pass over the source, run before parsing so that the chart
+// can be loaded into a single arena block
+// Hashes what the scanner has passed since the last call
+static inline void digest_scanned(struct digest_state *d,
+    const struct line_scanner *sc, const char *source)
+{
+    size_t pos = (sc->pos < sc->len ? sc->pos : sc->len);
+    update_digest(d, source + d->len, pos - d->len);
+}
+
+// Sizes the arena and the note arrays for the whole source
+// Returns false if out of memory
+static bool count_storage(struct loader *ld, const char *source, size_t len,
+    struct digest_state *digest)
+{
+    struct bm_tracks *tracks = &ld->chart->tracks;
+    struct line_scanner sc;
+    struct line_entry lines[LINE_BATCH];
+    const struct bm_allocator *alloc = get_allocator(ld->ctx->alloc);
+    int *bg_caps = NULL;    // Note capacity of each background track
+    int bg_count = 0, bg_caps_len = 0;
+    size_t strings = 128;   // Defaults for missing metadata
+    int n;
+
+    init_scanner(&sc, source, len, !(ld->flags & BM_LOAD_SCALAR));
+    while ((n = scan_lines(&sc, lines, LINE_BATCH)) > 0) {
+        if (digest != NULL) digest_scanned(digest, &sc, source);
+        for (int i = 0; i < n; i++) {
+            const char *s = source + lines[i].start;
+            int line_len = lines[i].len;
+            if (!lines[i].is_track) {
+                strings += (line_len + ARENA_ALIGN) & ~(ARENA_ALIGN - 1);
+                continue;
+            }
+
+            int bar = s[0] * 100 + s[1] * 10 + s[2] - '0' * 111;
+            int track = s[3] * 10 + s[4] - '0' * 11;
+            struct bm_track *t = fixed_track(tracks, track);
+            if (t != NULL) {
+                t->note_cap += count_notes(s + 6, line_len - 6);
+            } else if (track == 1 && reach_bar(ld, bar)) {
+                int index = ld->bars[bar].bg_counted++;
+                if (index >= bg_caps_len) {
+                    int cap = (bg_caps_len == 0 ? 8 : bg_caps_len * 2);
+                    int *caps = (int *)mem_realloc(alloc, bg_caps, cap * sizeof(int));
+                    if (caps == NULL) continue;
+                    memset(caps + bg_caps_len, 0, (cap - bg_caps_len) * sizeof(int));
+                    bg_caps = caps;
+                    bg_caps_len = cap;
+                }
+                bg_caps[index] += count_notes(s + 6, line_len - 6);
+                if (bg_count <= index) bg_count = index + 1;
+            }
+        }
+    }
+
+    size_t notes = 0;
+    for (int i = 0; i < bg_count; i++)
+        notes += bg_caps[i];
+    for (int i = 0; i < 60; i++)
+        notes += tracks->object[i].note_cap;
+    notes += tracks->tempo.note_cap + tracks->bga_base.note_cap +
+        tracks->bga_layer.note_cap + tracks->bga_poor.note_cap +
+        tracks->ex_tempo.note_cap + tracks->stop.note_cap;
+
+    // Each array is rounded up to the alignment separately
+    size_t total = notes * sizeof(struct bm_note) + bg_count * sizeof(struct bm_track) +
+        (bg_count + 67) * ARENA_ALIGN + strings;
+    if (!arena_add_block(alloc, &ld->chart->arena, total)) {
+        mem_free(alloc, bg_caps);
+        return false;
+    }
+
+    tracks->background = (struct bm_track *)
+        arena_alloc(&ld->chart->arena, bg_count * sizeof(struct bm_track));
+    memset(tracks->background, 0, bg_count * sizeof(struct bm_track));
+    ld->bg_cap = bg_count;
+    for (int i = 0; i < bg_count; i++) {
+        tracks->background[i].note_cap = bg_caps[i];
+        reserve_notes(&ld->chart->arena, &tracks->background[i]);
+    }
+    mem_free(alloc, bg_caps);
+    for (int i = 0; i < 60; i++)
+        reserve_notes(&ld->chart->arena, &tracks->object[i]);
+    reserve_notes(&ld->chart->arena, &tracks->tempo);
+    reserve_notes(&ld->chart->arena, &tracks->bga_base);
+    reserve_notes(&ld->chart->arena, &tracks->bga_layer);
+    reserve_notes(&ld->chart->arena, &tracks->bga_poor);
+    reserve_notes(&ld->chart->arena, &tracks->ex_tempo);
+    reserve_notes(&ld->chart->arena, &tracks->stop);
+    return true;
+}
+
+// Commands
+// Looked up with a perfect hash of the length and the first three
+// characters, fixed at compile time; a collision between two entries
+// shows up as an overridden initializer (-Woverride-init)
+
+enum command_kind {
+    CMD_META_INT,       // `field` is the offset in struct bm_metadata
+    CMD_META_FLOAT,
+    CMD_META_STRING,
+    CMD_WAV,            // Indexed by two trailing base-36 digits
+    CMD_BMP,
+    // Kinds below only affect track data
+    CMD_TEMPO,
+    CMD_STOP,
+    CMD_LNOBJ,
+};
+
+struct command {
+    const char *name;
+    unsigned char name_len;
+    unsigned char len;  // Including index digits
+    unsigned char kind;
+    unsigned short field;
+    int min, max;       // Range of numeric values
+};
+
+#define command_hash(_len, _c0, _c1, _c2) \
+    (((_len) + (_c0) * 30 + (_c1) * 31 + (_c2)) & 63)
+
+#define command(_name, _c0, _c1, _c2, _kind, ...) \
+    [command_hash(sizeof(_name) - 1, _c0, _c1, _c2)] = \
+    { _name, sizeof(_name) - 1, sizeof(_name) - 1, _kind, __VA_ARGS__ }
+#define indexed_command(_name, _c0, _c1, _c2, _kind, ...) \
+    [command_hash(sizeof(_name) + 1, _c0, _c1, _c2)] = \
+    { _name, sizeof(_name) - 1, sizeof(_name) + 1, _kind, __VA_ARGS__ }
+#define meta_field(_f)  offsetof(struct bm_metadata, _f)
+
+static const struct command commands[64] = {
+    command("PLAYER", 'P', 'L', 'A', CMD_META_INT, meta_field(player_num), 1, 3),
+    command("GENRE", 'G', 'E', 'N', CMD_META_STRING, meta_field(genre)),
+    command("TITLE", 'T', 'I', 'T', CMD_META_STRING, meta_field(title)),
+    command("ARTIST", 'A', 'R', 'T', CMD_META_STRING, meta_field(artist)),
+    command("SUBARTIST", 'S', 'U', 'B', CMD_META_STRING, meta_field(subartist)),
+    command("BPM", 'B', 'P', 'M', CMD_META_FLOAT, meta_field(init_tempo), 1, 999),
+    command("PLAYLEVEL", 'P', 'L', 'A', CMD_META_INT, meta_field(play_level), 1, 999),
+    command("RANK", 'R', 'A', 'N', CMD_META_INT, meta_field(judge_rank), 0, 3),
+    command("TOTAL", 'T', 'O', 'T', CMD_META_INT, meta_field(gauge_total), 1, 9999),
+    command("DIFFICULTY", 'D', 'I', 'F', CMD_META_INT, meta_field(difficulty), 1, 5),
+    command("STAGEFILE", 'S', 'T', 'A', CMD_META_STRING, meta_field(stage_file)),
+    command("BANNER", 'B', 'A', 'N', CMD_META_STRING, meta_field(banner)),
+    command("BACKBMP", 'B', 'A', 'C', CMD_META_STRING, meta_field(back_bmp)),
+    indexed_command("WAV", 'W', 'A', 'V', CMD_WAV, 0),
+    indexed_command("BMP", 'B', 'M', 'P', CMD_BMP, 0),
+    indexed_command("BPM", 'B', 'P', 'M', CMD_TEMPO, 0, 1, 999),
+    indexed_command("STOP", 'S', 'T', 'O', CMD_STOP, 0, 0, 32767),
+    command("LNOBJ", 'L', 'N', 'O', CMD_LNOBJ, 0),
+};
+
+static inline const struct command *find_command(const char *s, int len)
+{
+    if (len < 2) return NULL;
+    const struct command *cmd =
+        &commands[command_hash(len, s[0], s[1], len > 2 ? s[2] : 0)];
+    if (cmd->name == NULL || cmd->len != len ||
+        memcmp(s, cmd->name, cmd->name_len) != 0)
+    {
+        return NULL;
+    }
+    if (cmd->name_len < len && (!isbase36(s[len - 2]) || !isbase36(s[len - 1])))
+        return NULL;
+    return cmd;
+}
+
+// The name is [0, *name_len) and the argument [*arg, len), empty if *arg >= len
+static inline void split_command(const char *s, int len, int *name_len, int *arg)
+{
+    int p = 0;
+    while (p < len && !is_blank(s[p])) p++;
+    *name_len = p++;
+    while (p < len && is_blank(s[p])) p++;
+    *arg = p;
+}
+
+// Lines are handled in two steps: decoding, which only depends on the line
+// and reports the diagnostics that do not depend on what came before, and
+// applying the result to the chart; random branches decode each line once
+
+// Marks a track line of `bar` as seen, reporting redefined tracks
+// Returns NULL if there is no memory to keep track of the bar
+static struct bar_state *mark_track(struct loader *ld, int line, int bar, int track)
+{
+    struct bm_parse_ctx *ctx = ld->ctx;
+    if (!reach_bar(ld, bar)) return NULL;
+    struct bar_state *b = &ld->bars[bar];
+    uint64_t bit = (uint64_t)1 << (track & 63);
+    if (track >= 3 && track <= 69 && track != 5 && track % 10 != 0 &&
+        (b->appeared[track >> 6] & bit))
+    {
+        emit_log_int(line, BM_LOG_TRACK_REDEFINED, track);
+    }
+    b->appeared[track >> 6] |= bit;
+    return b;
+}
+
+// Each background line of a bar goes into the next track
+// Returns NULL if out of memory
+static struct bm_track *next_background(struct loader *ld, struct bar_state *b)
+{
+    int index = b->bg_loaded;
+    struct bm_track *t = reach_background(ld, index);
+    if (t == NULL) return NULL;
+    b->bg_loaded++;
+    if (ld->chart->tracks.background_count <= index)
+        ld->chart->tracks.background_count = index + 1;
+    return t;
+}
+
+// Returns the time signature in quarters of a beat, or 0 if invalid
+static int decode_time_sig(struct bm_parse_ctx *ctx, int line, const char *s, int len)
+{
+    char buf[64];
+    errno = 0;
+    float x = strtof(span_str(buf, sizeof buf, s, len), NULL);
+    if (errno != EINVAL && x >= 0.25 && x <= 63.75) {
+        int y = (int)(x * 4 + 0.5);
+        if (fabs(y - x * 4) >= 1e-3)
+            emit_log_int(line, BM_LOG_INEXACT_TIME_SIG, y);
+        return y;
+    }
+    emit_log(line, BM_LOG_INVALID_TIME_SIG, 0, 0, NULL, 0);
+    return 0;
+}
+
+static void set_time_sig(struct loader *ld, int line, int bar, int time_sig)
+{
+    struct bm_parse_ctx *ctx = ld->ctx;
+    if (ld->chart->tracks.time_sig[bar] != 0)
+        emit_log_int(line, BM_LOG_TIME_SIG_REDEFINED, bar);
+    ld->chart->tracks.time_sig[bar] = time_sig;
+}
+
+// A command with its argument parsed
+struct command_arg {
+    const struct command *cmd;
+    int name_len, arg;  // As split_command() gives
+    int index;          // Of indexed commands, -1 otherwise
+    bool valid;         // False if the argument was rejected
+    union {
+        int i;
+        float f;
+    } value;
+};
+
+// Returns false if the line has nothing to apply: the command is
+// unknown, has no argument or is skipped for `flags`
+static bool decode_command(struct bm_parse_ctx *ctx, int line,
+    const char *s, int line_len, int flags, struct command_arg *a)
+{
+    int name_len, arg;
+    split_command(s, line_len, &name_len, &arg);
+
+    if (arg >= line_len) {
+        emit_log(line, BM_LOG_EMPTY_ARGUMENT, 0, 0, NULL, 0);
+        return false;
+    }
+
+    const struct command *cmd = find_command(s, name_len);
+    if (cmd == NULL) {
+        emit_log_text(line, BM_LOG_UNKNOWN_COMMAND, s, name_len);
+        return false;
+    }
+
+    if ((flags & BM_LOAD_META_ONLY) && cmd->kind >= CMD_TEMPO) {
+        // Only affects track data
+        return false;
+    }
+
+    a->cmd = cmd;
+    a->name_len = name_len;
+    a->arg = arg;
+    // Indexed commands end with two base-36 digits
+    a->index = (cmd->name_len < cmd->len ?
+        base36(s[name_len - 2], s[name_len - 1]) : -1);
+    a->valid = true;
+
+    char buf[64];
+    switch (cmd->kind) {
+    case CMD_META_INT:
+    case CMD_STOP: {
+        errno = 0;
+        long x = strtol(span_str(buf, sizeof buf, s + arg, line_len - arg), NULL, 10);
+        if (errno != EINVAL && x >= cmd->min && x <= cmd->max) {
+            a->value.i = x;
+        } else {
+            emit_log(line, BM_LOG_INVALID_INT, cmd->min, cmd->max, NULL, 0);
+            a->valid = false;
+        }
+        break;
+    }
+    case CMD_META_FLOAT:
+    case CMD_TEMPO: {
+        errno = 0;
+        float x = strtof(span_str(buf, sizeof buf, s + arg, line_len - arg), NULL);
+        if (errno != EINVAL && x >= cmd->min && x <= cmd->max) {
+            a->value.f = x;
+        } else {
+            emit_log(line, BM_LOG_INVALID_FLOAT, cmd->min, cmd->max, NULL, 0);
+            a->valid = false;
+        }
+        break;
+    }
+    case CMD_LNOBJ:
+        if (arg + 1 < line_len && isbase36(s[arg]) && isbase36(s[arg + 1])) {
+            a->value.i = base36(s[arg], s[arg + 1]);
+        } else {
+            emit_log_text(line, BM_LOG_INVALID_INDEX,
+                s + arg, line_len - arg < 2 ? line_len - arg : 2);
+            a->valid = false;
+        }
+        break;
+    default:
+        // Strings are copied when applied
+        break;
+    }
+    return true;
+}
+
+// `s` is the line the command was decoded from
+// Returns false if the rest of the source should be skipped
+static bool apply_command(struct loader *ld, int line,
+    const char *s, int line_len, const struct command_arg *a)
+{
+    struct bm_parse_ctx *ctx = ld->ctx;
+    struct bm_chart *chart = ld->chart;
+    const struct command *cmd = a->cmd;
+    const char *digits = s + a->name_len - 2;
+    char *field = (char *)&chart->meta + cmd->field;
+
+    // `_code` and `_text` describe redefinitions
+    #define assign(_var, _initial, _x, _code, _text, _text_len) do { \
+        if ((_var) != (_initial)) emit_log_text(line, _code, _text, _text_len); \
+        (_var) = (_x); \
+    } while (0)
+
+    #define assign_dup(_var, _code, _text, _text_len) do { \
+        char *x = span_dup(&chart->arena, s + a->arg, line_len - a->arg); \
+        if (x != NULL) assign(_var, NULL, x, _code, _text, _text_len); \
+    } while (0)
+
+    switch (a->valid ? cmd->kind : -1) {
+    case CMD_META_INT:
+        assign(*(int *)field, -1, a->value.i,
+            BM_LOG_COMMAND_REDEFINED, cmd->name, cmd->name_len);
+        break;
+    case CMD_META_FLOAT:
+        assign(*(float *)field, -1, a->value.f,
+            BM_LOG_COMMAND_REDEFINED, cmd->name, cmd->name_len);
+        break;
+    case CMD_META_STRING:
+        assign_dup(*(char **)field, BM_LOG_COMMAND_REDEFINED, cmd->name, cmd->name_len);
+        break;
+    case CMD_WAV:
+        if (ld->flags & BM_LOAD_NO_TABLES) break;
+        assign_dup(chart->tables.wav[a->index], BM_LOG_WAV_REDEFINED, digits, 2);
+        break;
+    case CMD_BMP:
+        if (ld->flags & BM_LOAD_NO_TABLES) break;
+        assign_dup(chart->tables.bmp[a->index], BM_LOG_BMP_REDEFINED, digits, 2);
+        break;
+    case CMD_TEMPO:
+        assign(chart->tables.tempo[a->index], -1, a->value.f,
+            BM_LOG_TEMPO_REDEFINED, digits, 2);
+        break;
+    case CMD_STOP:
+        assign(chart->tables.stop[a->index], -1, a->value.i,
+            BM_LOG_STOP_REDEFINED, digits, 2);
+        break;
+    case CMD_LNOBJ:
+        assign(ld->lnobj, -1, a->value.i, BM_LOG_COMMAND_REDEFINED, "LNOBJ", 5);
+        break;
+    }
+
+    #undef assign
+    #undef assign_dup
+
+    return !((ld->flags & BM_LOAD_META_ONLY) && (ld->flags & BM_LOAD_STOP_EARLY) &&
+        meta_complete(&chart->meta));
+}
+
+// Handles a line starting with #, with `s` pointing after the # character
+// Returns false if the rest of the source should be skipped
+static bool load_line(struct loader *ld, int line,
+    const char *s, int line_len, bool is_track)
+{
+    struct bm_parse_ctx *ctx = ld->ctx;
+    struct bm_chart *chart = ld->chart;
+    int flags = ld->flags;
+
+    if (!is_track) {
+        // Command
+        struct command_arg a;
+        if (!decode_command(ctx, line, s, line_len, flags, &a)) return true;
+        return apply_command(ld, line, s, line_len, &a);
+    }
+
+    // Track data
+    if (flags & BM_LOAD_META_ONLY) return !(flags & BM_LOAD_STOP_EARLY);
+
+    int bar = s[0] * 100 + s[1] * 10 + s[2] - '0' * 111;
+    int track = s[3] * 10 + s[4] - '0' * 11;
+    struct bar_state *b;
+    struct bm_track *t;
+
+    // Lines are ignored if there is no memory to keep track of the bar
+    if ((b = mark_track(ld, line, bar, track)) == NULL) return true;
+
+    if (track == 2) {
+        // Time signature
+        int time_sig = decode_time_sig(ctx, line, s + 6, line_len - 6);
+        if (time_sig != 0) set_time_sig(ld, line, bar, time_sig);
+    } else if (track == 1) {
+        if ((t = next_background(ld, b)) != NULL)
+            parse_track(ld, line, s + 6, line_len - 6, t, bar);
+    } else if ((t = fixed_track(&chart->tracks, track)) != NULL) {
+        parse_track(ld, line, s + 6, line_len - 6, t, bar);
+    } else {
+        emit_log_text(line, BM_LOG_UNKNOWN_TRACK, s + 3, 2);
+    }
+
+    return true;
+}
+
+// Resets the chart and the loader for a new source
+static void begin_load(struct loader *ld, struct bm_parse_ctx *ctx,
+    struct bm_chart *chart, int flags)
+{
+    chart->meta.player_num = -1;
+    chart->meta.genre = NULL;
+    chart->meta.title = NULL;
+    chart->meta.artist = NULL;
+    chart->meta.subartist = NULL;
+    chart->meta.init_tempo = -1;
+    chart->meta.play_level = -1;
+    chart->meta.judge_rank = -1;
+    chart->meta.gauge_total = -1;
+    chart->meta.difficulty = -1;    // Omissible
+    chart->meta.stage_file = NULL;
+    chart->meta.banner = NULL;
+    chart->meta.back_bmp = NULL;
+    memset(&chart->tables.wav, 0, sizeof chart->tables.wav);
+    memset(&chart->tables.bmp, 0, sizeof chart->tables.bmp);
+    for (int i = 0; i < BM_INDEX_MAX; i++) chart->tables.tempo[i] = -1;
+    memset(&chart->tables.stop, -1, sizeof chart->tables.stop);
+    memset(&chart->tracks, 0, sizeof chart->tracks);
+    memset(&chart->digests, 0, sizeof chart->digests);
+    chart->arena = NULL;
+
+    ctx->log_count = ctx->log_total = 0;
+
+    memset(ld, 0, sizeof *ld);
+    ld->ctx = ctx;
+    ld->chart = chart;
+    ld->flags = flags;
+    ld->lnobj = -1;
+    ld->log_limit = ctx->log_limit;
+    if (flags & BM_LOAD_NO_LOGS) ctx->log_limit = 0;
+}
+
+// Parses the lines in [source, source + len), numbering them from `line`
+// `digest`, if not NULL, is updated with the source as it is scanned
+// Returns the number of the line after the last one,
+// or -1 if the loader has stopped early
+static int load_lines(struct loader *ld, const char *source, size_t len, int line,
+    struct digest_state *digest)
+{
+    // The source is never modified; all spans are delimited by lengths
+    struct line_scanner sc;
+    struct line_entry lines[LINE_BATCH];
+    init_scanner(&sc, source, len, !(ld->flags & BM_LOAD_SCALAR));
+    sc.line = line;
+
+    int n;
+    while ((n = scan_lines(&sc, lines, LINE_BATCH)) > 0) {
+        if (digest != NULL) digest_scanned(digest, &sc, source);
+        for (int i = 0; i < n; i++)
+            if (!load_line(ld, lines[i].line,
+                source + lines[i].start, lines[i].len, lines[i].is_track))
+                return -1;
+    }
+    return sc.line;
+}
+
+// Returns the number of diagnostics
+// Undoes begin_load() when out of memory; returns -1
+static int abort_load(struct loader *ld)
+{
+    mem_free(get_allocator(ld->ctx->alloc), ld->bars);
+    free_arena(ld->chart->arena);
+    ld->chart->arena = NULL;
+    ld->ctx->log_limit = ld->log_limit;
+    return -1;
+}
+
+static int end_load(struct loader *ld)
+{
+    struct bm_parse_ctx *ctx = ld->ctx;
+    struct bm_chart *chart = ld->chart;
+    mem_free(get_allocator(ctx->alloc), ld->bars);
+
+    // Postprocessing
+    if (!(ld->flags & BM_LOAD_META_ONLY)) finish_tracks(chart, ld->lnobj);
+
+    #define check_default(_var, _name, _initial, _val) do { \
+        if ((_var) == (_initial)) { \
+            emit_log(-1, BM_LOG_MISSING_INT, _val, 0, _name, sizeof(_name) - 1); \
+            (_var) = (_val); \
+        } \
+    } while (0)
+
+    #define check_default_no_log(_var, _name, _initial, _val) do { \
+        if ((_var) == (_initial)) (_var) = (_val); \
+    } while (0)
+
+    #define default_str(_lit) span_dup(&chart->arena, _lit, sizeof(_lit) - 1)
+
+    #define check_default_str(_var, _name, _lit) do { \
+        if ((_var) == NULL) { \
+            emit_log_text(-1, BM_LOG_MISSING_STRING, _name, sizeof(_name) - 1); \
+            (_var) = default_str(_lit); \
+        } \
+    } while (0)
+
+    check_default(chart->meta.player_num, "PLAYER", -1, 1);
+    check_default_str(chart->meta.genre, "GENRE", "(unknown)");
+    check_default_str(chart->meta.title, "TITLE", "(unknown)");
+    check_default_str(chart->meta.artist, "ARTIST", "(unknown)");
+    check_default_no_log(chart->meta.subartist, "SUBARTIST", NULL, default_str("(unknown)"));
+    check_default(chart->meta.init_tempo, "BPM", -1, 130);
+    check_default(chart->meta.play_level, "LEVEL", -1, 3);
+    check_default_no_log(chart->meta.judge_rank, "RANK", -1, 3);
+    check_default_no_log(chart->meta.gauge_total, "TOTAL", -1, 160);
+    check_default_no_log(chart->meta.stage_file, "STAGEFILE", NULL, default_str("(none)"));
+    check_default_no_log(chart->meta.banner, "BANNER", NULL, default_str("(none)"));
+    check_default_no_log(chart->meta.back_bmp, "BACKBMP", NULL, default_str("(none)"));
+
+    ctx->log_limit = ld->log_limit;
+    return ctx->log_count;
+}
+
+int bm_load_ctx(struct bm_parse_ctx *ctx, struct bm_chart *chart,
+    const char *source, size_t len, int flags)
+{
+    struct loader ld;
+    begin_load(&ld, ctx, chart, flags);
+
+    // Hashed in the first pass over the source
+    struct digest_state digest, *d = NULL;
+    if (flags & BM_LOAD_DIGESTS) init_digest(d = &digest);
+
+    if (!(flags & BM_LOAD_META_ONLY)) {
+        if (!count_storage(&ld, source, len, d)) return abort_load(&ld);
+        d = NULL;
+    } else if (!arena_add_block(get_allocator(ctx->alloc), &chart->arena, ARENA_MIN_BLOCK)) {
+        return abort_load(&ld);
+    }
+
+    load_lines(&ld, source, len, 1, d);
+
+    if (flags & BM_LOAD_DIGESTS) {
+        // The rest of the source if stopped early
+        update_digest(&digest, source + digest.len, len - digest.len);
+        finish_digest(&digest, &chart->digests);
+    }
+    return end_load(&ld);
+}
+
+int bm_load_n(struct bm_chart *chart, const char *source, size_t len, int flags)
+{
+    int ret = bm_load_ctx(&global_ctx, chart, source, len, flags);
+    bm_logs = global_ctx.logs;
+    return ret;
+}
+
+int bm_load(struct bm_chart *chart, const char *source)
+{
+    return bm_load_n(chart, source, strlen(source), 0);
+}
+
+// Reads everything from a descriptor that cannot be mapped (pipes, etc.)
+static char *read_all(const struct bm_allocator *alloc, int fd, size_t *len)
+{
+    size_t cap = 65536;
+    char *buf = (char *)mem_alloc(alloc, cap);
+    *len = 0;
+
+    while (buf != NULL) {
+        if (*len == cap) {
+            char *p = (char *)mem_realloc(alloc, buf, cap <<= 1);
+            if (p == NULL) { mem_free(alloc, buf); return NULL; }
+            buf = p;
+        }
+        long n = sys_read(fd, buf + *len, cap - *len);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            mem_free(alloc, buf);
+            return NULL;
+        }
+        *len += n;
+    }
+
+    return buf;
+}
+
+int bm_load_file_ctx(struct bm_parse_ctx *ctx, struct bm_chart *chart,
+    const char *path, int flags)
+{
+    int fd = sys_open(path);
+    if (fd == -1) return -1;
+
+#ifndef _WIN32
+    // Regular files are mapped and parsed directly from the page cache
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t len = st.st_size;
+        void *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            sys_close(fd);
+        #ifdef MADV_SEQUENTIAL
+            madvise(p, len, MADV_SEQUENTIAL);
+        #endif
+            int ret = bm_load_ctx(ctx, chart, (const char *)p, len, flags);
+            munmap(p, len);
+            return ret;
+        }
+    }
+#endif
+
+    const struct bm_allocator *alloc = get_allocator(ctx->alloc);
+    size_t len;
+    char *buf = read_all(alloc, fd, &len);
+    sys_close(fd);
+    if (buf == NULL) return -1;
+
+    int ret = bm_load_ctx(ctx, chart, buf, len, flags);
+    mem_free(alloc, buf);
+    return ret;
+}
+
+int bm_load_file(struct bm_chart *chart, const char *path)
+{
+    int ret = bm_load_file_ctx(&global_ctx, chart, path, 0);
+    if (ret != -1) bm_logs = global_ctx.logs;
+    return ret;
+}
+
+// Incremental loading
+// Complete lines are parsed directly from each chunk; only the incomplete
+// last line is copied, to be completed by the following chunks
+
+struct bm_stream {
+    struct loader ld;
+    int line;           // Number of the incomplete line
+    bool stopped;
+    bool skip_lf;       // The last chunk ended with \r
+    char *partial;
+    size_t partial_len, partial_cap;
+    struct digest_state digest; // Of every chunk, as it is fed
+};
+
+struct bm_stream *bm_stream_begin(struct bm_parse_ctx *ctx,
+    struct bm_chart *chart, int flags)
+{
+    const struct bm_allocator *alloc = get_allocator(ctx->alloc);
+    struct bm_stream *st = (struct bm_stream *)mem_alloc(alloc, sizeof(struct bm_stream));
+    if (st == NULL) return NULL;
+
+    // Note arrays grow as lines arrive, without a counting pass
+    begin_load(&st->ld, ctx, chart, flags);
+    if (!arena_add_block(alloc, &chart->arena, ARENA_MIN_BLOCK)) {
+        abort_load(&st->ld);
+        mem_free(alloc, st);
+        return NULL;
+    }
+
+    st->line = 1;
+    st->stopped = st->skip_lf = false;
+    st->partial = NULL;
+    st->partial_len = st->partial_cap = 0;
+    if (flags & BM_LOAD_DIGESTS) init_digest(&st->digest);
+    return st;
+}
+
+static bool append_partial(struct bm_stream *st, const char *s, size_t len)
+{
+    if (st->partial_cap < st->partial_len + len) {
+        size_t cap = (st->partial_cap == 0 ? 256 : st->partial_cap * 2);
+        while (cap < st->partial_len + len) cap *= 2;
+        char *partial = (char *)mem_realloc(get_allocator(st->ld.ctx->alloc),
+            st->partial, cap);
+        if (partial == NULL) return false;
+        st->partial = partial;
+        st->partial_cap = cap;
+    }
+    memcpy(st->partial + st->partial_len, s, len);
+    st->partial_len += len;
+    return true;
+}
+
+// Parses the lines of [s, s + len) with the loader
+static void stream_lines(struct bm_stream *st, const char *s, size_t len)
+{
+    st->line = load_lines(&st->ld, s, len, st->line, NULL);
+    if (st->line == -1) st->stopped = true;
+}
+
+// The rest of a line that cannot be kept would be taken for a new line,
+// so nothing more is parsed
+static int stream_oom(struct bm_stream *st)
+{
+    st->stopped = true;
+    return -1;
+}
+
+int bm_stream_feed(struct bm_stream *st, const char *chunk, size_t len)
+{
+    if (st->ld.flags & BM_LOAD_DIGESTS) update_digest(&st->digest, chunk, len);
+    if (st->stopped || len == 0) return 0;
+
+    size_t p = 0;
+    if (st->skip_lf && chunk[0] == '\n') p = 1;
+
+    // Just past the last line break in the chunk
+    size_t end = len;
+    while (end > p && !is_space_or_linebreak(chunk[end - 1])) end--;
+
+    if (end > p) {
+        if (st->partial_len > 0) {
+            // Complete the pending line with the start of the chunk
+            size_t q = p;
+            while (!is_space_or_linebreak(chunk[q])) q++;
+            if (!append_partial(st, chunk + p, q - p)) return stream_oom(st);
+            stream_lines(st, st->partial, st->partial_len);
+            st->partial_len = 0;
+            if (st->stopped) return 0;
+            p = q + 1;
+            if (chunk[q] == '\r' && p < len && chunk[p] == '\n') p++;
+        }
+        if (p < end) {
+            stream_lines(st, chunk + p, end - p);
+            if (st->stopped) return 0;
+        }
+        p = end;
+    }
+    st->skip_lf = (end == len && chunk[len - 1] == '\r');
+
+    if (p < len && !append_partial(st, chunk + p, len - p)) return stream_oom(st);
+    return 0;
+}
+
+int bm_stream_end(struct bm_stream *st)
+{
+    if (!st->stopped && st->partial_len > 0)
+        load_lines(&st->ld, st->partial, st->partial_len, st->line, NULL);
+    if (st->ld.flags & BM_LOAD_DIGESTS) finish_digest(&st->digest, &st->ld.chart->digests);
+
+    int ret = end_load(&st->ld);
+    const struct bm_allocator *alloc = get_allocator(st->ld.ctx->alloc);
+    mem_free(alloc, st->partial);
+    mem_free(alloc, st);
+    return ret;
+}
+
+// Callback parsing
+
+struct sax_sink {
+    const struct bm_sax *sax;
+    int line, bar, channel;
+    int stop;
+};
+
+static void report_pair(void *user, int i, int count, int value)
+{
+    struct sax_sink *t = (struct sax_sink *)user;
+    if (t->stop == 0)
+        t->stop = t->sax->on_channel_pair(t->sax->user, t->line,
+            t->bar, t->channel, i, count, value);
+}
+
+int bm_parse_sax(const struct bm_sax *sax, const char *source, size_t len, int flags)
+{
+    // Holds the diagnostics of one line at a time, if they are wanted
+    struct bm_parse_ctx log_ctx, *ctx = &log_ctx;
+    bm_init_ctx(ctx);
+    if (sax->on_diagnostic == NULL) ctx->log_limit = 0;
+
+    struct line_scanner sc;
+    struct line_entry lines[LINE_BATCH];
+    init_scanner(&sc, source, len, !(flags & BM_LOAD_SCALAR));
+
+    struct sax_sink sink = { sax, 0, 0, 0, 0 };
+    int n;
+    while (sink.stop == 0 && (n = scan_lines(&sc, lines, LINE_BATCH)) > 0)
+        for (int i = 0; i < n && sink.stop == 0; i++) {
+            const char *s = source + lines[i].start;
+            int line_len = lines[i].len;
+            sink.line = lines[i].line;
+
+            if (lines[i].is_track) {
+                sink.bar = s[0] * 100 + s[1] * 10 + s[2] - '0' * 111;
+                sink.channel = s[3] * 10 + s[4] - '0' * 11;
+                if (sink.channel == 2) {
+                    if (sax->on_channel_text != NULL)
+                        sink.stop = sax->on_channel_text(sax->user, sink.line,
+                            sink.bar, sink.channel, s + 6, line_len - 6);
+                } else if (sax->on_channel_pair != NULL) {
+                    decode_pairs(ctx, sink.line, s + 6, line_len - 6, flags,
+                        report_pair, &sink);
+                }
+            } else if (sax->on_header != NULL) {
+                int name_len, arg;
+                split_command(s, line_len, &name_len, &arg);
+                if (arg > line_len) arg = line_len;
+                sink.stop = sax->on_header(sax->user, sink.line,
+                    s, name_len, s + arg, line_len - arg);
+            }
+
+            for (int j = 0; j < ctx->log_count; j++)
+                sax->on_diagnostic(sax->user, &ctx->logs[j]);
+            ctx->log_count = 0;
+        }
+
+    bm_close_ctx(ctx);
+    return ctx->log_total;
+}
+
+// Random branches
+// The source is scanned once into runs of ordinary lines between #IF,
+// #ELSEIF, #ELSE and #ENDIF, with each alternative linked to the next so
+// that branches not taken are jumped over; every #IF is resolved when
+// parsing to the #RANDOM (or #SETRANDOM value) that it tests
+// Ordinary lines are decoded as they are scanned, and loading a variant
+// only applies the results
+
+enum branch_kind { OP_LINES, OP_IF, OP_ELSEIF, OP_ELSE, OP_ENDIF };
+
+struct branch_op {
+    int kind;
+    int first, count;   // OP_LINES: the lines
+    int random;         // OP_IF, OP_ELSEIF: the #RANDOM tested, or -1 for `fixed`
+    int fixed;          // #SETRANDOM value in effect, 0 if none
+    int value;          // Compared with the value of the above
+    int next;           // Except OP_LINES and OP_ENDIF: the next alternative or #ENDIF
+    int end;            // Except OP_LINES and OP_ENDIF: the #ENDIF
+};
+
+// An ordinary line, decoded
+struct line_record {
+    int line;
+    int start, len;             // In the copied source, after the #
+    int log_first, log_count;   // Diagnostics from decoding
+    bool is_track;
+    // Track data
+    unsigned char track;
+    short bar;
+    int time_sig;               // Track 02: 0 if invalid
+    int note_first, note_count; // Other tracks
+    // Commands; `cmd` is NULL if there is nothing to apply
+    struct command_arg command;
+};
+
+struct bm_branches {
+    const struct bm_allocator *alloc;
+    char *source;
+    int record_count, record_cap;
+    struct line_record *records;
+    int note_count, note_cap;
+    struct bm_note *notes;
+    int log_count;
+    struct bm_log *logs;
+    int op_count, op_cap;
+    struct branch_op *ops;
+    int random_count, random_cap;
+    int *random_range;
+    struct bm_digests digests;
+};
+
+enum control_kind {
+    CTRL_NONE, CTRL_RANDOM, CTRL_SETRANDOM, CTRL_ENDRANDOM,
+    CTRL_IF, CTRL_ELSEIF, CTRL_ELSE, CTRL_ENDIF,
+};
+
+static inline int control_kind(const char *s, int len)
+{
+    #define is(_name) (len == sizeof(_name) - 1 && memcmp(s, _name, len) == 0)
+    if (is("RANDOM")) return CTRL_RANDOM;
+    if (is("SETRANDOM")) return CTRL_SETRANDOM;
+    if (is("ENDRANDOM")) return CTRL_ENDRANDOM;
+    if (is("IF")) return CTRL_IF;
+    if (is("ELSEIF")) return CTRL_ELSEIF;
+    if (is("ELSE")) return CTRL_ELSE;
+    if (is("ENDIF")) return CTRL_ENDIF;
+    #undef is
+    return CTRL_NONE;
+}
+
+// Makes room for item `count` in `*items`; false if out of memory
+static bool grow_items(const struct bm_allocator *alloc, void **items,
+    int *cap, int count, size_t size)
+{
+    if (count < *cap) return true;
+    int new_cap = (*cap == 0 ? 16 : (*cap << 1));
+    void *p = mem_realloc(alloc, *items, new_cap * size);
+    if (p == NULL) return false;
+    *items = p;
+    *cap = new_cap;
+    return true;
+}
+
+#define grow_array(_alloc, _items, _cap, _count) \
+    grow_items(_alloc, (void **)&(_items), &(_cap), _count, sizeof *(_items))
+
+// An #IF being parsed
+struct branch_frame {
+    int first, head;    // The #IF and its last alternative so far
+    int depth;          // Random scopes open outside of it
+    int line;
+};
+
+// A #RANDOM or #SETRANDOM in effect
+struct random_scope {
+    int random, fixed;
+};
+
+struct branch_parser {
+    struct bm_parse_ctx *ctx;
+    struct bm_parse_ctx decode; // Collects the diagnostics of records
+    struct bm_branches *br;
+    int flags;
+    short bar;                  // Of the track line being decoded
+    int frame_count, frame_cap;
+    struct branch_frame *frames;
+    int scope_count, scope_cap;
+    struct random_scope *scopes;
+    bool oom;
+};
+
+// Returns the index of the new operation, or -1 if out of memory
+static int add_op(struct branch_parser *p, int kind, int value)
+{
+    struct bm_branches *br = p->br;
+    if (!grow_array(br->alloc, br->ops, br->op_cap, br->op_count)) {
+        p->oom = true;
+        return -1;
+    }
+    struct branch_op *op = &br->ops[br->op_count];
+    memset(op, 0, sizeof *op);
+    op->kind = kind;
+    op->random = -1;
+    op->value = value;
+    if (p->scope_count > 0) {
+        op->random = p->scopes[p->scope_count - 1].random;
+        op->fixed = p->scopes[p->scope_count - 1].fixed;
+    }
+    return br->op_count++;
+}
+
+static void push_scope(struct branch_parser *p, int random, int fixed)
+{
+    if (!grow_array(p->br->alloc, p->scopes, p->scope_cap, p->scope_count)) {
+        p->oom = true;
+        return;
+    }
+    p->scopes[p->scope_count].random = random;
+    p->scopes[p->scope_count++].fixed = fixed;
+}
+
+// Closes the alternative at the head of the innermost #IF and starts
+// another one, or the #ENDIF if `kind` is OP_ENDIF
+static void add_alternative(struct branch_parser *p, int kind, int value)
+{
+    struct branch_frame *f = &p->frames[p->frame_count - 1];
+    // Random scopes opened inside the branch end with it
+    p->scope_count = f->depth;
+    int i = add_op(p, kind, value);
+    if (i == -1) return;
+    struct branch_op *ops = p->br->ops;
+    ops[f->head].next = i;
+    f->head = i;
+    if (kind == OP_ENDIF) {
+        for (int k = f->first; k != i; k = ops[k].next) ops[k].end = i;
+        p->frame_count--;
+    }
+}
+
+static void parse_control(struct branch_parser *p, int line, int kind,
+    const char *s, int len)
+{
+    struct bm_parse_ctx *ctx = p->ctx;
+    struct bm_branches *br = p->br;
+    static const char *const names[] = {
+        NULL, "RANDOM", "SETRANDOM", "ENDRANDOM", "IF", "ELSEIF", "ELSE", "ENDIF",
+    };
+
+    // Arguments are positive; invalid ones match no branch
+    long x = INT_MIN;
+    if (kind == CTRL_RANDOM || kind == CTRL_SETRANDOM ||
+        kind == CTRL_IF || kind == CTRL_ELSEIF)
+    {
+        char buf[32];
+        errno = 0;
+        x = strtol(span_str(buf, sizeof buf, s, len), NULL, 10);
+        if (errno == EINVAL || x < 1 || x > INT_MAX) {
+            emit_log(line, BM_LOG_INVALID_INT, 1, INT_MAX, NULL, 0);
+            x = INT_MIN;
+        }
+    }
+
+    if ((kind == CTRL_ELSEIF || kind == CTRL_ELSE || kind == CTRL_ENDIF) &&
+        p->frame_count == 0)
+    {
+        emit_log_text(line, BM_LOG_UNMATCHED_CONTROL, names[kind], strlen(names[kind]));
+        return;
+    }
+
+    switch (kind) {
+    case CTRL_RANDOM:
+        if (x == INT_MIN) {
+            push_scope(p, -1, 0);
+        } else if (grow_array(br->alloc, br->random_range, br->random_cap, br->random_count)) {
+            br->random_range[br->random_count] = x;
+            push_scope(p, br->random_count++, 0);
+        } else {
+            p->oom = true;
+        }
+        break;
+    case CTRL_SETRANDOM:
+        push_scope(p, -1, (x == INT_MIN ? 0 : x));
+        break;
+    case CTRL_ENDRANDOM:
+        if (p->scope_count > (p->frame_count > 0 ? p->frames[p->frame_count - 1].depth : 0))
+            p->scope_count--;
+        else
+            emit_log_text(line, BM_LOG_UNMATCHED_CONTROL, names[kind], strlen(names[kind]));
+        break;
+    case CTRL_IF: {
+        int i = add_op(p, OP_IF, x);
+        if (i == -1) break;
+        if (!grow_array(br->alloc, p->frames, p->frame_cap, p->frame_count)) {
+            p->oom = true;
+            break;
+        }
+        struct branch_frame *f = &p->frames[p->frame_count++];
+        f->first = f->head = i;
+        f->depth = p->scope_count;
+        f->line = line;
+        break;
+    }
+    case CTRL_ELSEIF:
+        add_alternative(p, OP_ELSEIF, x);
+        break;
+    case CTRL_ELSE:
+        add_alternative(p, OP_ELSE, 0);
+        break;
+    case CTRL_ENDIF:
+        add_alternative(p, OP_ENDIF, 0);
+        break;
+    }
+}
+
+static void add_decoded_note(void *user, int i, int count, int value)
+{
+    struct branch_parser *p = (struct branch_parser *)user;
+    struct bm_branches *br = p->br;
+    if (!grow_array(br->alloc, br->notes, br->note_cap, br->note_count)) {
+        p->oom = true;
+        return;
+    }
+    set_note(&br->notes[br->note_count++], p->bar, i, count, value);
+}
+
+// Decodes an ordinary line, extending the run of lines before it
+static void add_record(struct branch_parser *p, const struct line_entry *entry)
+{
+    struct bm_parse_ctx *ctx = &p->decode;
+    struct bm_branches *br = p->br;
+    if (!grow_array(br->alloc, br->records, br->record_cap, br->record_count)) {
+        p->oom = true;
+        return;
+    }
+    struct line_record *r = &br->records[br->record_count];
+    const char *s = br->source + entry->start;
+    int len = entry->len;
+    memset(r, 0, sizeof *r);
+    r->line = entry->line;
+    r->start = entry->start;
+    r->len = len;
+    r->log_first = ctx->log_count;
+    r->is_track = entry->is_track;
+    r->note_first = br->note_count;
+
+    if (!entry->is_track) {
+        if (!decode_command(ctx, r->line, s, len, 0, &r->command))
+            r->command.cmd = NULL;
+    } else {
+        r->bar = s[0] * 100 + s[1] * 10 + s[2] - '0' * 111;
+        r->track = s[3] * 10 + s[4] - '0' * 11;
+        if (r->track == 2) {
+            r->time_sig = decode_time_sig(ctx, r->line, s + 6, len - 6);
+        } else if (r->track == 1 || is_fixed_track(r->track)) {
+            p->bar = r->bar;
+            decode_pairs(ctx, r->line, s + 6, len - 6, p->flags, add_decoded_note, p);
+        } else {
+            emit_log_text(r->line, BM_LOG_UNKNOWN_TRACK, s + 3, 2);
+        }
+    }
+    r->note_count = br->note_count - r->note_first;
+    r->log_count = ctx->log_count - r->log_first;
+
+    if (br->op_count == 0 || br->ops[br->op_count - 1].kind != OP_LINES) {
+        int i = add_op(p, OP_LINES, 0);
+        if (i == -1) return;
+        br->ops[i].first = br->record_count;
+    }
+    br->ops[br->op_count - 1].count++;
+    br->record_count++;
+}
+
+struct bm_branches *bm_parse_branches(struct bm_parse_ctx *ctx,
+    const char *source, size_t len, int flags)
+{
+    const struct bm_allocator *alloc = get_allocator(ctx->alloc);
+    struct bm_branches *br = (struct bm_branches *)mem_alloc(alloc, sizeof(struct bm_branches));
+    if (br == NULL) return NULL;
+    memset(br, 0, sizeof(struct bm_branches));
+    br->alloc = alloc;
+    br->source = (char *)mem_alloc(alloc, len > 0 ? len : 1);
+    if (br->source == NULL) {
+        bm_close_branches(br);
+        return NULL;
+    }
+    memcpy(br->source, source, len);
+    source = br->source;
+    ctx->log_count = ctx->log_total = 0;
+
+    struct branch_parser p;
+    memset(&p, 0, sizeof p);
+    p.ctx = ctx;
+    bm_init_ctx(&p.decode);
+    p.decode.alloc = alloc;
+    p.br = br;
+    p.flags = flags;
+
+    struct digest_state digest;
+    if (flags & BM_LOAD_DIGESTS) init_digest(&digest);
+
+    struct line_scanner sc;
+    struct line_entry lines[LINE_BATCH];
+    init_scanner(&sc, source, len, !(flags & BM_LOAD_SCALAR));
+    int n;
+    while (!p.oom && (n = scan_lines(&sc, lines, LINE_BATCH)) > 0) {
+        if (flags & BM_LOAD_DIGESTS) digest_scanned(&digest, &sc, source);
+        for (int i = 0; i < n && !p.oom; i++) {
+            const char *s = source + lines[i].start;
+            int name_len, arg, kind = CTRL_NONE;
+            if (!lines[i].is_track) {
+                split_command(s, lines[i].len, &name_len, &arg);
+                kind = control_kind(s, name_len);
+            }
+            if (kind == CTRL_NONE)
+                add_record(&p, &lines[i]);
+            else
+                parse_control(&p, lines[i].line, kind, s + arg,
+                    arg < lines[i].len ? lines[i].len - arg : 0);
+        }
+    }
+
+    while (!p.oom && p.frame_count > 0) {
+        emit_log(p.frames[p.frame_count - 1].line, BM_LOG_MISSING_ENDIF, 0, 0, NULL, 0);
+        add_alternative(&p, OP_ENDIF, 0);
+    }
+    if (flags & BM_LOAD_DIGESTS) {
+        update_digest(&digest, source + digest.len, len - digest.len);
+        finish_digest(&digest, &br->digests);
+    }
+
+    mem_free(alloc, p.frames);
+    mem_free(alloc, p.scopes);
+    br->logs = p.decode.logs;
+    br->log_count = p.decode.log_count;
+    if (p.oom) {
+        bm_close_branches(br);
+        return NULL;
+    }
+    return br;
+}
+
+void bm_close_branches(struct bm_branches *br)
+{
+    if (br == NULL) return;
+    mem_free(br->alloc, br->source);
+    mem_free(br->alloc, br->records);
+    mem_free(br->alloc, br->notes);
+    mem_free(br->alloc, br->logs);
+    mem_free(br->alloc, br->ops);
+    mem_free(br->alloc, br->random_range);
+    mem_free(br->alloc, br);
+}
+
+int bm_random_count(const struct bm_branches *br)
+{
+    return br->random_count;
+}
+
+int bm_random_range(const struct bm_branches *br, int index)
+{
+    return (index >= 0 && index < br->random_count ? br->random_range[index] : 0);
+}
+
+static void replay_logs(struct bm_parse_ctx *ctx, const struct bm_log *logs, int count)
+{
+    for (int i = 0; i < count; i++)
+        emit_log(logs[i].line, logs[i].code, logs[i].a, logs[i].b,
+            logs[i].text, (int)strlen(logs[i].text));
+}
+
+// Does what load_line() does with the line the record was decoded from
+static bool load_record(struct loader *ld, const struct bm_branches *br,
+    const struct line_record *r)
+{
+    struct bm_parse_ctx *ctx = ld->ctx;
+    const struct bm_log *logs = br->logs + r->log_first;
+    int flags = ld->flags;
+
+    if (!r->is_track) {
+        // Command
+        const struct command *cmd = r->command.cmd;
+        if (cmd != NULL && (flags & BM_LOAD_META_ONLY) && cmd->kind >= CMD_TEMPO)
+            return true;
+        replay_logs(ctx, logs, r->log_count);
+        return cmd == NULL ||
+            apply_command(ld, r->line, br->source + r->start, r->len, &r->command);
+    }
+
+    // Track data
+    if (flags & BM_LOAD_META_ONLY) return !(flags & BM_LOAD_STOP_EARLY);
+
+    struct bar_state *b;
+    struct bm_track *t = NULL;
+    if ((b = mark_track(ld, r->line, r->bar, r->track)) == NULL) return true;
+    if (r->track == 1 && (t = next_background(ld, b)) == NULL) return true;
+    if (r->track > 2) t = fixed_track(&ld->chart->tracks, r->track);
+
+    replay_logs(ctx, logs, r->log_count);
+    if (r->track == 2 && r->time_sig != 0)
+        set_time_sig(ld, r->line, r->bar, r->time_sig);
+    else if (t != NULL)
+        add_notes(&ld->chart->arena, t, br->notes + r->note_first, r->note_count);
+    return true;
+}
+
+int bm_load_variant(struct bm_parse_ctx *ctx, struct bm_chart *chart,
+    const struct bm_branches *br, const int *values, int flags)
+{
+    struct loader ld;
+    begin_load(&ld, ctx, chart, flags);
+    chart->digests = br->digests;
+    // Note arrays grow as lines are loaded, without a counting pass
+    if (!arena_add_block(get_allocator(ctx->alloc), &chart->arena, ARENA_MIN_BLOCK))
+        return abort_load(&ld);
+
+    bool testing = false;   // Looking for the alternative to take
+    for (int i = 0; i < br->op_count; ) {
+        const struct branch_op *op = &br->ops[i];
+        if (op->kind == OP_LINES) {
+            int j = op->first, end = op->first + op->count;
+            for (; j < end; j++)
+                if (!load_record(&ld, br, &br->records[j])) break;
+            if (j < end) break;
+            i++;
+        } else if (op->kind == OP_ENDIF) {
+            testing = false;
+            i++;
+        } else if (op->kind != OP_IF && !testing) {
+            // An alternative before was taken
+            i = op->end;
+        } else if (op->kind == OP_ELSE ||
+            (op->random < 0 ? op->fixed :
+                values != NULL ? values[op->random] : 1) == op->value)
+        {
+            testing = false;
+            i++;
+        } else {
+            testing = true;
+            i = op->next;
+        }
+    }
+
+    return end_load(&ld);
+}
+
+// Compact charts
+// Laid out in one block in order of decreasing alignment: the structure,
+// pointer arrays, track headers, notes, then the narrower arrays and strings
+
+static inline void *take(char **p, size_t size)
+{
+    void *x = *p;
+    *p += size;
+    return x;
+}
+
+static inline size_t str_size(const char *s)
+{
+    return (s != NULL ? strlen(s) + 1 : 0);
+}
+
+static inline char *copy_str(char **p, const char *s)
+{
+    if (s == NULL) return NULL;
+    size_t n = strlen(s) + 1;
+    return (char *)memcpy(take(p, n), s, n);
+}
+
+// Calls `_fn(track, id)` for every track other than backgrounds
+// in increasing order of id
+#define for_each_track(_tracks, _fn) do { \
+    _fn(&(_tracks)->tempo, 3); \
+    _fn(&(_tracks)->bga_base, 4); \
+    _fn(&(_tracks)->bga_poor, 6); \
+    _fn(&(_tracks)->bga_layer, 7); \
+    _fn(&(_tracks)->ex_tempo, 8); \
+    _fn(&(_tracks)->stop, 9); \
+    for (int i = 11; i <= 69; i++) \
+        if (i % 10 != 0) _fn(&(_tracks)->object[i - 10], i); \
+} while (0)
+
+struct bm_compact_chart *bm_chart_compact(const struct bm_chart *chart)
+{
+    const struct bm_tables *tables = &chart->tables;
+    const struct bm_metadata *meta = &chart->meta;
+    int wav_count = 0, bmp_count = 0, tempo_count = 0, stop_count = 0;
+    int time_sig_count = 0, track_count = 0;
+    size_t note_count = 0, strings = 0;
+
+    for (int i = 0; i < BM_INDEX_MAX; i++) {
+        if (tables->wav[i] != NULL) wav_count++;
+        if (tables->bmp[i] != NULL) bmp_count++;
+        if (tables->tempo[i] != -1) tempo_count++;
+        if (tables->stop[i] != -1) stop_count++;
+        strings += str_size(tables->wav[i]) + str_size(tables->bmp[i]);
+    }
+    for (int i = 0; i < BM_BARS_COUNT; i++)
+        if (chart->tracks.time_sig[i] != 0) time_sig_count++;
+    #define count_track(_track, _id) do { \
+        if ((_track)->note_count > 0) { \
+            track_count++; \
+            note_count += (_track)->note_count; \
+        } \
+    } while (0)
+    for_each_track(&chart->tracks, count_track);
+    #undef count_track
+    int background_count = chart->tracks.background_count;
+    for (int i = 0; i < background_count; i++)
+        note_count += chart->tracks.background[i].note_count;
+    strings += str_size(meta->genre) + str_size(meta->title) +
+        str_size(meta->artist) + str_size(meta->subartist) +
+        str_size(meta->stage_file) + str_size(meta->banner) +
+        str_size(meta->back_bmp);
+
+    size_t size = sizeof(struct bm_compact_chart) +
+        (wav_count + bmp_count) * sizeof(char *) +
+        (background_count + track_count) * sizeof(struct bm_track) +
+        note_count * sizeof(struct bm_note) +
+        tempo_count * sizeof(float) +
+        (wav_count + bmp_count + tempo_count + stop_count * 2 + time_sig_count) *
+            sizeof(short) +
+        time_sig_count + track_count + strings;
+
+    const struct bm_allocator *alloc =
+        (chart->arena != NULL ? chart->arena->alloc : default_allocator);
+    char *p = (char *)mem_alloc(alloc, size);
+    if (p == NULL) return NULL;
+
+    struct bm_compact_chart *c =
+        (struct bm_compact_chart *)take(&p, sizeof(struct bm_compact_chart));
+    c->alloc = alloc;
+    c->size = size;
+    c->wav_count = wav_count;
+    c->bmp_count = bmp_count;
+    c->tempo_count = tempo_count;
+    c->stop_count = stop_count;
+    c->time_sig_count = time_sig_count;
+    c->background_count = background_count;
+    c->track_count = track_count;
+
+    c->wav = (char **)take(&p, wav_count * sizeof(char *));
+    c->bmp = (char **)take(&p, bmp_count * sizeof(char *));
+    c->background = (struct bm_track *)take(&p, background_count * sizeof(struct bm_track));
+    c->tracks = (struct bm_track *)take(&p, track_count * sizeof(struct bm_track));
+    struct bm_note *notes = (struct bm_note *)take(&p, note_count * sizeof(struct bm_note));
+    c->tempo = (float *)take(&p, tempo_count * sizeof(float));
+    c->wav_index = (short *)take(&p, wav_count * sizeof(short));
+    c->bmp_index = (short *)take(&p, bmp_count * sizeof(short));
+    c->tempo_index = (short *)take(&p, tempo_count * sizeof(short));
+    c->stop_index = (short *)take(&p, stop_count * sizeof(short));
+    c->stop = (short *)take(&p, stop_count * sizeof(short));
+    c->time_sig_bar = (short *)take(&p, time_sig_count * sizeof(short));
+    c->time_sig = (unsigned char *)take(&p, time_sig_count);
+    c->track_id = (signed char *)take(&p, track_count);
+
+    int w = 0, b = 0, t = 0, s = 0;
+    for (int i = 0; i < BM_INDEX_MAX; i++) {
+        if (tables->wav[i] != NULL) {
+            c->wav_index[w] = i;
+            c->wav[w++] = copy_str(&p, tables->wav[i]);
+        }
+        if (tables->bmp[i] != NULL) {
+            c->bmp_index[b] = i;
+            c->bmp[b++] = copy_str(&p, tables->bmp[i]);
+        }
+        if (tables->tempo[i] != -1) {
+            c->tempo_index[t] = i;
+            c->tempo[t++] = tables->tempo[i];
+        }
+        if (tables->stop[i] != -1) {
+            c->stop_index[s] = i;
+            c->stop[s++] = tables->stop[i];
+        }
+    }
+    for (int i = 0, k = 0; i < BM_BARS_COUNT; i++)
+        if (chart->tracks.time_sig[i] != 0) {
+            c->time_sig_bar[k] = i;
+            c->time_sig[k++] = chart->tracks.time_sig[i];
+        }
+
+    // Background tracks may be empty, with no notes to copy from
+    #define copy_notes(_dst, _track) do { \
+        (_dst)->note_count = (_dst)->note_cap = (_track)->note_count; \
+        (_dst)->notes = NULL; \
+        if ((_track)->note_count > 0) { \
+            (_dst)->notes = (struct bm_note *)memcpy(notes, (_track)->notes, \
+                (_track)->note_count * sizeof(struct bm_note)); \
+            notes += (_track)->note_count; \
+        } \
+    } while (0)
+    for (int i = 0; i < background_count; i++)
+        copy_notes(&c->background[i], &chart->tracks.background[i]);
+    int k = 0;
+    #define copy_track(_track, _id) do { \
+        if ((_track)->note_count > 0) { \
+            c->track_id[k] = (_id); \
+            copy_notes(&c->tracks[k], _track); \
+            k++; \
+        } \
+    } while (0)
+    for_each_track(&chart->tracks, copy_track);
+    #undef copy_track
+    #undef copy_notes
+
+    c->digests = chart->digests;
+    c->meta = *meta;
+    c->meta.genre = copy_str(&p, meta->genre);
+    c->meta.title = copy_str(&p, meta->title);
+    c->meta.artist = copy_str(&p, meta->artist);
+    c->meta.subartist = copy_str(&p, meta->subartist);
+    c->meta.stage_file = copy_str(&p, meta->stage_file);
+    c->meta.banner = copy_str(&p, meta->banner);
+    c->meta.back_bmp = copy_str(&p, meta->back_bmp);
+
+    return c;
+}
+
+void bm_close_compact(struct bm_compact_chart *compact)
+{
+    if (compact != NULL) mem_free(compact->alloc, compact);
+}
+
+// Position of `key` in the sorted array `keys`, or -1 if absent
+static inline int find_key(const short *keys, int n, int key)
+{
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (keys[mid] < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return (lo < n && keys[lo] == key ? lo : -1);
+}
+
+const char *bm_compact_wav(const struct bm_compact_chart *c, int index)
+{
+    int i = find_key(c->wav_index, c->wav_count, index);
+    return (i != -1 ? c->wav[i] : NULL);
+}
+
+const char *bm_compact_bmp(const struct bm_compact_chart *c, int index)
+{
+    int i = find_key(c->bmp_index, c->bmp_count, index);
+    return (i != -1 ? c->bmp[i] : NULL);
+}
+
+float bm_compact_tempo(const struct bm_compact_chart *c, int index)
+{
+    int i = find_key(c->tempo_index, c->tempo_count, index);
+    return (i != -1 ? c->tempo[i] : -1);
+}
+
+int bm_compact_stop(const struct bm_compact_chart *c, int index)
+{
+    int i = find_key(c->stop_index, c->stop_count, index);
+    return (i != -1 ? c->stop[i] : -1);
+}
+
+int bm_compact_time_sig(const struct bm_compact_chart *c, int bar)
+{
+    int i = find_key(c->time_sig_bar, c->time_sig_count, bar);
+    return (i != -1 ? c->time_sig[i] : 0);
+}
+
+const struct bm_track *bm_compact_track(const struct bm_compact_chart *c, int id)
+{
+    if (id <= 0)
+        return (-id < c->background_count && c->background[-id].note_count > 0 ?
+            &c->background[-id] : NULL);
+    int lo = 0, hi = c->track_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (c->track_id[mid] < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return (lo < c->track_count && c->track_id[lo] == id ? &c->tracks[lo] : NULL);
+}
+
+void bm_chart_expand(const struct bm_compact_chart *c, struct bm_chart *chart)
+{
+    chart->meta = c->meta;
+    chart->digests = c->digests;
+    memset(&chart->tables.wav, 0, sizeof chart->tables.wav);
+    memset(&chart->tables.bmp, 0, sizeof chart->tables.bmp);
+    for (int i = 0; i < BM_INDEX_MAX; i++) chart->tables.tempo[i] = -1;
+    memset(&chart->tables.stop, -1, sizeof chart->tables.stop);
+    memset(&chart->tracks, 0, sizeof chart->tracks);
+    chart->arena = NULL;
+
+    for (int i = 0; i < c->wav_count; i++) chart->tables.wav[c->wav_index[i]] = c->wav[i];
+    for (int i = 0; i < c->bmp_count; i++) chart->tables.bmp[c->bmp_index[i]] = c->bmp[i];
+    for (int i = 0; i < c->tempo_count; i++) chart->tables.tempo[c->tempo_index[i]] = c->tempo[i];
+    for (int i = 0; i < c->stop_count; i++) chart->tables.stop[c->stop_index[i]] = c->stop[i];
+    for (int i = 0; i < c->time_sig_count; i++)
+        chart->tracks.time_sig[c->time_sig_bar[i]] = c->time_sig[i];
+
+    chart->tracks.background_count = c->background_count;
+    chart->tracks.background = c->background;
+    for (int i = 0; i < c->track_count; i++)
+        *fixed_track(&chart->tracks, c->track_id[i]) = c->tracks[i];
+}
+
+size_t bm_chart_memory(const struct bm_chart *chart)
+{
+    size_t size = sizeof(struct bm_chart);
+    for (const struct bm_arena *a = chart->arena; a != NULL; a = a->next)
+        size += ARENA_HEADER + a->size;
+    return size;
+}
+
+// Compiled charts
+// A header with the metadata and tables, where pointers are replaced by
+// offsets from the start of the file, followed by the note arrays, the
+// events and the strings; loading fills in a chart that points into the file
+
+#define COMPILED_MAGIC      "BMFC"
+#define COMPILED_VERSION    4
+#define COMPILED_TRACKS     66
+
+struct compiled_track {
+    uint32_t offset;
+    int32_t count;
+};
+
+struct compiled_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;    // 0x01020304 as written
+    uint16_t note_size, event_size;
+    uint64_t file_size;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t source_hash;
+
+    int32_t player_num, play_level, judge_rank, gauge_total, difficulty;
+    float init_tempo;
+    uint32_t genre, title, artist, subartist, stage_file, banner, back_bmp;
+
+    uint32_t wav[BM_INDEX_MAX], bmp[BM_INDEX_MAX];
+    float tempo[BM_INDEX_MAX];
+    int16_t stop[BM_INDEX_MAX];
+
+    uint8_t time_sig[BM_BARS_COUNT];
+    int32_t background_count;
+    uint32_t background;    // Array of background_count compiled_track
+    struct compiled_track tracks[COMPILED_TRACKS];
+
+    int32_t resolution, event_count, long_note_count;
+    uint32_t events, long_notes;
+
+    struct bm_digests digests;
+};
+
+#define COMPILED_DATA \
+    ((sizeof(struct compiled_header) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+// Object tracks, then the others in declaration order
+static inline struct bm_track *track_at(struct bm_tracks *tracks, int i)
+{
+    if (i < 60) return &tracks->object[i];
+    switch (i - 60) {
+    case 0: return &tracks->tempo;
+    case 1: return &tracks->bga_base;
+    case 2: return &tracks->bga_layer;
+    case 3: return &tracks->bga_poor;
+    case 4: return &tracks->ex_tempo;
+    default: return &tracks->stop;
+    }
+}
+
+// 64-bit FNV-1a
+static uint64_t hash_bytes(uint64_t h, const char *p, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)p[i]) * 0x100000001b3ull;
+    return h;
+}
+
+#define HASH_INIT   0xcbf29ce484222325ull
+
+void bm_stamp_source(struct bm_source_stamp *stamp, const char *source, size_t len)
+{
+    stamp->size = len;
+    stamp->mtime = 0;
+    stamp->hash = hash_bytes(HASH_INIT, source, len);
+}
+
+int bm_stamp_file(struct bm_source_stamp *stamp, const char *path, int hash)
+{
+    int fd = sys_open(path);
+    if (fd == -1) return -1;
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_fstat64(fd, &st) != 0) { sys_close(fd); return -1; }
+#else
+    struct stat st;
+    if (fstat(fd, &st) != 0) { sys_close(fd); return -1; }
+#endif
+    stamp->size = st.st_size;
+    stamp->mtime = st.st_mtime;
+    stamp->hash = 0;
+
+    if (hash) {
+        char buf[65536];
+        uint64_t h = HASH_INIT;
+        long n;
+        while ((n = sys_read(fd, buf, sizeof buf)) != 0) {
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                sys_close(fd);
+                return -1;
+            }
+            h = hash_bytes(h, buf, n);
+        }
+        stamp->hash = h;
+    }
+
+    sys_close(fd);
+    return 0;
+}
+
+static inline uint32_t put_bytes(char *image, size_t *pos, const void *p, size_t size)
+{
+    uint32_t offset = *pos;
+    if (size > 0) memcpy(image + offset, p, size);
+    *pos += size;
+    return offset;
+}
+
+// 0 for NULL
+static inline uint32_t put_str(char *image, size_t *pos, const char *s)
+{
+    return (s != NULL ? put_bytes(image, pos, s, strlen(s) + 1) : 0);
+}
+
+int bm_save_compiled(const char *path, const struct bm_chart *chart,
+    const struct bm_seq *seq, const struct bm_source_stamp *source)
+{
+    struct bm_tracks *tracks = (struct bm_tracks *)&chart->tracks;
+    const struct bm_metadata *meta = &chart->meta;
+    int event_count = (seq != NULL ? seq->event_count : 0);
+    int long_note_count = (seq != NULL ? seq->long_note_count : 0);
+
+    size_t size = COMPILED_DATA +
+        (event_count + long_note_count) * sizeof(struct bm_event) +
+        tracks->background_count * sizeof(struct compiled_track);
+    for (int i = 0; i < tracks->background_count; i++)
+        size += tracks->background[i].note_count * sizeof(struct bm_note);
+    for (int i = 0; i < COMPILED_TRACKS; i++)
+        size += track_at(tracks, i)->note_count * sizeof(struct bm_note);
+    for (int i = 0; i < BM_INDEX_MAX; i++)
+        size += str_size(chart->tables.wav[i]) + str_size(chart->tables.bmp[i]);
+    size += str_size(meta->genre) + str_size(meta->title) +
+        str_size(meta->artist) + str_size(meta->subartist) +
+        str_size(meta->stage_file) + str_size(meta->banner) +
+        str_size(meta->back_bmp);
+    if (size > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    // Zeroed so that padding is written out deterministically
+    char *image = (char *)mem_alloc(default_allocator, size);
+    if (image == NULL) return -1;
+    memset(image, 0, COMPILED_DATA);
+    struct compiled_header *h = (struct compiled_header *)image;
+    size_t pos = COMPILED_DATA;
+
+    memcpy(h->magic, COMPILED_MAGIC, 4);
+    h->version = COMPILED_VERSION;
+    h->byte_order = 0x01020304;
+    h->note_size = sizeof(struct bm_note);
+    h->event_size = sizeof(struct bm_event);
+    h->file_size = size;
+    if (source != NULL) {
+        h->source_size = source->size;
+        h->source_mtime = source->mtime;
+        h->source_hash = source->hash;
+    }
+
+    // Arrays first, as they need alignment and strings do not
+    struct compiled_track *background = (struct compiled_track *)(image + pos);
+    h->background = pos;
+    pos += tracks->background_count * sizeof(struct compiled_track);
+    for (int i = 0; i < tracks->background_count; i++) {
+        const struct bm_track *t = &tracks->background[i];
+        background[i].count = t->note_count;
+        background[i].offset = put_bytes(image, &pos, t->notes,
+            t->note_count * sizeof(struct bm_note));
+    }
+    for (int i = 0; i < COMPILED_TRACKS; i++) {
+        const struct bm_track *t = track_at(tracks, i);
+        h->tracks[i].count = t->note_count;
+        h->tracks[i].offset = put_bytes(image, &pos, t->notes,
+            t->note_count * sizeof(struct bm_note));
+    }
+    h->resolution = 48;     // As bm_to_seq() uses, for files without a sequence
+    if (seq != NULL) {
+        h->resolution = seq->resolution;
+        h->event_count = event_count;
+        h->long_note_count = long_note_count;
+        h->events = put_bytes(image, &pos, seq->events,
+            event_count * sizeof(struct bm_event));
+        h->long_notes = put_bytes(image, &pos, seq->long_notes,
+            long_note_count * sizeof(struct bm_event));
+    }
+
+    h->player_num = meta->player_num;
+    h->play_level = meta->play_level;
+    h->judge_rank = meta->judge_rank;
+    h->gauge_total = meta->gauge_total;
+    h->difficulty = meta->difficulty;
+    h->init_tempo = meta->init_tempo;
+    h->genre = put_str(image, &pos, meta->genre);
+    h->title = put_str(image, &pos, meta->title);
+    h->artist = put_str(image, &pos, meta->artist);
+    h->subartist = put_str(image, &pos, meta->subartist);
+    h->stage_file = put_str(image, &pos, meta->stage_file);
+    h->banner = put_str(image, &pos, meta->banner);
+    h->back_bmp = put_str(image, &pos, meta->back_bmp);
+
+    for (int i = 0; i < BM_INDEX_MAX; i++) {
+        h->wav[i] = put_str(image, &pos, chart->tables.wav[i]);
+        h->bmp[i] = put_str(image, &pos, chart->tables.bmp[i]);
+        h->tempo[i] = chart->tables.tempo[i];
+        h->stop[i] = chart->tables.stop[i];
+    }
+    memcpy(h->time_sig, tracks->time_sig, BM_BARS_COUNT);
+    h->background_count = tracks->background_count;
+    h->digests = chart->digests;
+
+    FILE *f = fopen(path, "wb");
+    int ret = -1;
+    if (f != NULL) {
+        if (fwrite(image, size, 1, f) == 1) ret = 0;
+        if (fclose(f) != 0) ret = -1;
+    }
+    mem_free(default_allocator, image);
+    return ret;
+}
+
+// Events loaded from a file stay in it; arrays allocated later
+// (e.g. by bm_build_index()) come from the default allocator
+static void *file_alloc(void *user, size_t size)
+{
+    (void)user;
+    return mem_alloc(default_allocator, size);
+}
+
+static void *file_realloc(void *user, void *ptr, size_t size)
+{
+    (void)user;
+    return mem_realloc(default_allocator, ptr, size);
+}
+
+static void file_free(void *user, void *ptr)
+{
+    const struct bm_arena *a = (const struct bm_arena *)user;
+    uintptr_t p = (uintptr_t)ptr, file = (uintptr_t)a->file;
+    if (p < file || p >= file + a->file_len) mem_free(default_allocator, ptr);
+}
+
+static inline bool span_in(size_t len, uint32_t offset, size_t count, size_t size)
+{
+    return offset % 4 == 0 && offset <= len && count <= (len - offset) / size;
+}
+
+static inline bool str_in(const char *file, size_t len, uint32_t offset)
+{
+    return offset == 0 ||
+        (offset < len && memchr(file + offset, '\0', len - offset) != NULL);
+}
+
+// Within the bars that bm_to_seq() lays out, on an actual division of the
+// bar; `min_value` is -1 for object tracks, where -1 ends a held note
+static bool notes_in(const struct bm_note *notes, int count, int bar_count,
+    int min_value)
+{
+    for (int i = 0; i < count; i++) {
+        const struct bm_note *n = &notes[i];
+        if (n->bar < 0 || n->bar >= bar_count || n->den == 0 || n->num >= n->den ||
+            n->value < min_value || n->value >= BM_INDEX_MAX)
+            return false;
+        if (n->value == -1 && (i == 0 || !notes[i - 1].hold || notes[i - 1].value == -1))
+            return false;
+    }
+    return true;
+}
+
+// Types, tracks and indices that the sequence functions rely on
+static bool events_in(const struct bm_event *events, int count)
+{
+    for (int i = 0; i < count; i++) {
+        const struct bm_event *ev = &events[i];
+        switch ((int)ev->type) {
+        case BM_NOTE: case BM_NOTE_LONG: case BM_NOTE_OFF:
+            if (ev->track > 0 ? ev->track < 10 || ev->track >= 10 + BM_OBJECT_LANES :
+                ev->track <= -BM_BGM_TRACKS)
+                return false;
+            // Fall through
+        case BM_BGA_BASE_CHANGE: case BM_BGA_LAYER_CHANGE: case BM_BGA_POOR_CHANGE:
+            if (ev->value < 0 || ev->value >= BM_INDEX_MAX) return false;
+            // Fall through
+        case BM_BARLINE: case BM_TEMPO_CHANGE: case BM_STOP:
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool check_compiled(const char *file, size_t len,
+    const struct bm_source_stamp *expect)
+{
+    const struct compiled_header *h = (const struct compiled_header *)file;
+    if (len < COMPILED_DATA || memcmp(h->magic, COMPILED_MAGIC, 4) != 0 ||
+        h->version != COMPILED_VERSION || h->byte_order != 0x01020304 ||
+        h->note_size != sizeof(struct bm_note) ||
+        h->event_size != sizeof(struct bm_event) || h->file_size != len)
+    {
+        return false;
+    }
+
+    if (expect != NULL && (h->source_size != expect->size ||
+        h->source_mtime != expect->mtime ||
+        (expect->hash != 0 && h->source_hash != expect->hash)))
+    {
+        return false;
+    }
+
+    const struct compiled_track *background =
+        (const struct compiled_track *)(file + h->background);
+    bool ok = h->background_count >= 0 &&
+        span_in(len, h->background, h->background_count, sizeof(struct compiled_track)) &&
+        h->event_count >= 0 && h->long_note_count >= 0 &&
+        span_in(len, h->events, h->event_count, sizeof(struct bm_event)) &&
+        span_in(len, h->long_notes, h->long_note_count, sizeof(struct bm_event)) &&
+        str_in(file, len, h->genre) && str_in(file, len, h->title) &&
+        str_in(file, len, h->artist) && str_in(file, len, h->subartist) &&
+        str_in(file, len, h->stage_file) && str_in(file, len, h->banner) &&
+        str_in(file, len, h->back_bmp);
+    for (int i = 0; ok && i < BM_INDEX_MAX; i++)
+        ok = str_in(file, len, h->wav[i]) && str_in(file, len, h->bmp[i]);
+    if (!ok) return false;
+
+    // Contents, now that every array is known to lie within the file
+    int bar_count = 0;
+    while (bar_count < BM_BARS_COUNT && h->time_sig[bar_count] != 0) bar_count++;
+    if (bar_count < BM_BARS_COUNT) bar_count++;
+
+    for (int i = 0; ok && i < h->background_count; i++)
+        ok = background[i].count >= 0 &&
+            span_in(len, background[i].offset, background[i].count, sizeof(struct bm_note)) &&
+            notes_in((const struct bm_note *)(file + background[i].offset),
+                background[i].count, bar_count, 0);
+    for (int i = 0; ok && i < COMPILED_TRACKS; i++)
+        ok = h->tracks[i].count >= 0 &&
+            span_in(len, h->tracks[i].offset, h->tracks[i].count, sizeof(struct bm_note)) &&
+            notes_in((const struct bm_note *)(file + h->tracks[i].offset),
+                h->tracks[i].count, bar_count, (i < 60 ? -1 : 0));
+    if (!ok) return false;
+
+    const struct bm_event *long_notes = (const struct bm_event *)(file + h->long_notes);
+    for (int i = 0; i < h->long_note_count; i++)
+        if (long_notes[i].type != BM_NOTE_LONG) return false;
+    return h->resolution > 0 &&
+        events_in((const struct bm_event *)(file + h->events), h->event_count) &&
+        events_in(long_notes, h->long_note_count);
+}
+
+int bm_load_compiled(const char *path, struct bm_chart *chart,
+    struct bm_seq *seq, const struct bm_source_stamp *expect)
+{
+    int fd = sys_open(path);
+    if (fd == -1) return -1;
+
+    // The arena block holds the allocator for the sequence
+    struct bm_arena *arena = NULL;
+    if (!arena_add_block(default_allocator, &arena, sizeof(struct bm_allocator))) {
+        sys_close(fd);
+        return -1;
+    }
+
+#ifndef _WIN32
+    // Mapped privately, so that the chart may still be modified
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            arena->file = (char *)p;
+            arena->file_len = st.st_size;
+            arena->file_mapped = true;
+        }
+    }
+#endif
+    if (arena->file == NULL)
+        arena->file = read_all(default_allocator, fd, &arena->file_len);
+    sys_close(fd);
+    if (arena->file == NULL) {
+        free_arena(arena);
+        return -1;
+    }
+
+    const char *file = arena->file;
+    if (!check_compiled(file, arena->file_len, expect)) {
+        free_arena(arena);
+        errno = EINVAL;
+        return -1;
+    }
+    const struct compiled_header *h = (const struct compiled_header *)file;
+
+    // Everything is allocated before the chart is written to, so that it is
+    // left untouched on failure; the first block has room for the allocator
+    struct bm_arena *blocks = arena;
+    struct bm_allocator *alloc = NULL;
+    if (seq != NULL)
+        alloc = (struct bm_allocator *)arena_alloc(&blocks, sizeof(struct bm_allocator));
+    struct bm_track *background_tracks = (struct bm_track *)
+        arena_alloc(&blocks, h->background_count * sizeof(struct bm_track));
+    if ((seq != NULL && alloc == NULL) ||
+        (background_tracks == NULL && h->background_count > 0))
+    {
+        free_arena(blocks);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    #define at(_offset) ((_offset) != 0 ? arena->file + (_offset) : NULL)
+
+    chart->meta.player_num = h->player_num;
+    chart->meta.genre = at(h->genre);
+    chart->meta.title = at(h->title);
+    chart->meta.artist = at(h->artist);
+    chart->meta.subartist = at(h->subartist);
+    chart->meta.init_tempo = h->init_tempo;
+    chart->meta.play_level = h->play_level;
+    chart->meta.judge_rank = h->judge_rank;
+    chart->meta.gauge_total = h->gauge_total;
+    chart->meta.difficulty = h->difficulty;
+    chart->meta.stage_file = at(h->stage_file);
+    chart->meta.banner = at(h->banner);
+    chart->meta.back_bmp = at(h->back_bmp);
+
+    for (int i = 0; i < BM_INDEX_MAX; i++) {
+        chart->tables.wav[i] = at(h->wav[i]);
+        chart->tables.bmp[i] = at(h->bmp[i]);
+        chart->tables.tempo[i] = h->tempo[i];
+        chart->tables.stop[i] = h->stop[i];
+    }
+    memcpy(chart->tracks.time_sig, h->time_sig, BM_BARS_COUNT);
+    chart->digests = h->digests;
+    for (int i = 0; i < COMPILED_TRACKS; i++) {
+        struct bm_track *t = track_at(&chart->tracks, i);
+        t->note_count = t->note_cap = h->tracks[i].count;
+        t->notes = (struct bm_note *)(arena->file + h->tracks[i].offset);
+    }
+
+    const struct compiled_track *background =
+        (const struct compiled_track *)(file + h->background);
+    chart->tracks.background_count = h->background_count;
+    chart->tracks.background = background_tracks;
+    for (int i = 0; i < h->background_count; i++) {
+        struct bm_track *t = &chart->tracks.background[i];
+        t->note_count = t->note_cap = background[i].count;
+        t->notes = (struct bm_note *)(arena->file + background[i].offset);
+    }
+    chart->arena = blocks;
+
+    if (seq != NULL) {
+        alloc->alloc_fn = file_alloc;
+        alloc->realloc_fn = file_realloc;
+        alloc->free_fn = file_free;
+        alloc->user = arena;
+        memset(seq, 0, sizeof(struct bm_seq));
+        seq->alloc = alloc;
+        seq->resolution = h->resolution;
+        seq->event_count = h->event_count;
+        seq->events = (struct bm_event *)(arena->file + h->events);
+        seq->long_note_count = h->long_note_count;
+        seq->long_notes = (struct bm_event *)(arena->file + h->long_notes);
+    }
+
+    #undef at
+    return 0;
+}
+
+// Sequence building
+// Each source track is read by a cursor that yields its events in order;
+// the cursors are combined with a k-way merge straight into the sequence
+
+static inline int gcd(int a, int b)
+{
+    while (b != 0) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Raises `*res` so that all notes of the track fall on ticks;
+// returns false if it would exceed `limit`
+static bool fit_resolution(const struct bm_track *track,
+    const unsigned char *time_sig, int *res, int limit)
+{
+    for (int i = 0; i < track->note_count; i++) {
+        const struct bm_note *note = &track->notes[i];
+        int x = note->num * time_sig[note->bar];
+        int d = note->den / gcd(x, note->den);
+        if (*res % d == 0) continue;
+        int64_t r = (int64_t)(*res / gcd(*res, d)) * d;
+        if (r > limit) return false;
+        *res = (int)r;
+    }
+    return true;
+}
+
+static int auto_resolution(const struct bm_chart *chart, int beats)
+{
+    const struct bm_tracks *t = &chart->tracks;
+    int limit = INT_MAX / (beats > 0 ? beats : 1);
+    int res = 1;
+    bool fits = fit_resolution(&t->tempo, t->time_sig, &res, limit) &&
+        fit_resolution(&t->ex_tempo, t->time_sig, &res, limit) &&
+        fit_resolution(&t->bga_base, t->time_sig, &res, limit) &&
+        fit_resolution(&t->bga_layer, t->time_sig, &res, limit) &&
+        fit_resolution(&t->bga_poor, t->time_sig, &res, limit) &&
+        fit_resolution(&t->stop, t->time_sig, &res, limit);
+    for (int i = 0; fits && i < t->background_count; i++)
+        fits = fit_resolution(&t->background[i], t->time_sig, &res, limit);
+    for (int i = 0; fits && i < 60; i++)
+        fits = fit_resolution(&t->object[i], t->time_sig, &res, limit);
+    return (fits ? res : 48);
+}
+
+static inline int note_tick(const struct bm_note *note, const int *bar_start,
+    const unsigned char *time_sig, int res, bool nearest)
+{
+    int64_t x = (int64_t)note->num * time_sig[note->bar] * res;
+    int64_t frac = (nearest ? (x * 2 + note->den) / (note->den * 2) : x / note->den);
+    return (int)((int64_t)bar_start[note->bar] * res + frac);
+}
+
+// Bar lines, tempo (2), BGA (3), stops and objects, besides backgrounds
+#define FIXED_TRACKS    (1 + 2 + 3 + 1 + 60)
+// Cursor indices fit in the low 24 bits of a merge key
+#define MAX_TRACKS      (1 << 24)
+
+enum cursor_kind {
+    CURSOR_BARLINE, CURSOR_TEMPO, CURSOR_EX_TEMPO, CURSOR_STOP,
+    CURSOR_PLAIN, CURSOR_OBJECT
+};
+
+// An object track is read as three streams, of normal notes, long note
+// starts and long note ends, each in order of position; other tracks
+// only use the first
+struct seq_cursor {
+    struct bm_event event;      // The next event
+    const struct bm_track *track;
+    unsigned char kind, type;
+    signed char channel;
+    int next[3];
+    int pos[3];
+};
+
+struct seq_layout {
+    const struct bm_chart *chart;
+    const int *bar_start;
+    int bar_count, res;
+    bool nearest;
+};
+
+static inline int layout_tick(const struct seq_layout *l, const struct bm_note *note)
+{
+    return note_tick(note, l->bar_start, l->chart->tracks.time_sig, l->res, l->nearest);
+}
+
+// Notes without a counterpart (a held note with no end or the reverse)
+// belong to no stream
+static inline bool in_stream(const struct bm_note *notes, int count, int i, int stream)
+{
+    switch (stream) {
+    case 0: return notes[i].value != -1 && !notes[i].hold;
+    case 1: return notes[i].hold && i + 1 < count && notes[i + 1].value == -1;
+    default: return notes[i].value == -1 && i > 0 && notes[i - 1].hold;
+    }
+}
+
+static inline void seek_stream(struct seq_cursor *c, const struct seq_layout *l, int stream)
+{
+    const struct bm_note *notes = c->track->notes;
+    int count = c->track->note_count;
+    int i = c->next[stream];
+    if (c->kind == CURSOR_OBJECT)
+        while (i < count && !in_stream(notes, count, i, stream)) i++;
+    c->next[stream] = i;
+    if (i < count) c->pos[stream] = layout_tick(l, &notes[i]);
+}
+
+static void open_cursor(struct seq_cursor *c, const struct seq_layout *l,
+    int kind, const struct bm_track *track, int type, int channel)
+{
+    c->track = track;
+    c->kind = kind;
+    c->type = type;
+    c->channel = channel;
+    for (int s = 0; s < 3; s++) c->next[s] = 0;
+    if (track == NULL) return;
+    seek_stream(c, l, 0);
+    if (kind == CURSOR_OBJECT) {
+        seek_stream(c, l, 1);
+        seek_stream(c, l, 2);
+    }
+}
+
+// Moves the next event of the cursor into `c->event`; returns false
+// once the track is exhausted
+static bool read_cursor(struct seq_cursor *c, const struct seq_layout *l)
+{
+    struct bm_event *ev = &c->event;
+
+    if (c->kind == CURSOR_BARLINE) {
+        int i = c->next[0]++;
+        if (i >= l->bar_count) return false;
+        ev->pos = l->bar_start[i] * l->res;
+        ev->type = BM_BARLINE;
+        ev->track = 0;
+        ev->value = i;
+        ev->value_a = l->chart->tracks.time_sig[i];
+        return true;
+    }
+
+    const struct bm_note *notes = c->track->notes;
+    int count = c->track->note_count;
+
+    // The earliest stream; ties go to the lower event type
+    int s = -1;
+    for (int t = 0; t < (c->kind == CURSOR_OBJECT ? 3 : 1); t++)
+        if (c->next[t] < count && (s == -1 || c->pos[t] < c->pos[s])) s = t;
+    if (s == -1) return false;
+
+    const struct bm_note *note = &notes[c->next[s]];
+    ev->pos = c->pos[s];
+    ev->track = c->channel;
+
+    switch (c->kind) {
+    case CURSOR_TEMPO:
+        ev->type = BM_TEMPO_CHANGE;
+        ev->value = 0;
+        ev->value_f = note->value;
+        break;
+    case CURSOR_EX_TEMPO:
+        ev->type = BM_TEMPO_CHANGE;
+        ev->value = 0;
+        ev->value_f = l->chart->tables.tempo[note->value];
+        break;
+    case CURSOR_STOP:
+        ev->type = BM_STOP;
+        ev->value = l->chart->tables.stop[note->value];
+        ev->value_a = 0;
+        break;
+    case CURSOR_PLAIN:
+        ev->type = (enum bm_event_type)c->type;
+        ev->value = note->value;
+        ev->value_a = 0;
+        break;
+    default:
+        if (s == 0) {
+            // Normal note
+            ev->type = BM_NOTE;
+            ev->value = note->value;
+            ev->value_a = 0;
+        } else if (s == 1) {
+            // Start of a long note, reported with its duration
+            ev->type = BM_NOTE_LONG;
+            ev->value = note->value;
+            ev->value_a = layout_tick(l, note + 1) - ev->pos;
+        } else {
+            // Release of a long note, paired with the start
+            // to simplify time-range queries
+            ev->type = BM_NOTE_OFF;
+            ev->value = note[-1].value;
+            ev->value_a = ev->pos - layout_tick(l, note - 1);
+        }
+    }
+
+    c->next[s]++;
+    seek_stream(c, l, s);
+    return true;
+}
+
+// Ties are broken by cursor index, so the result is what a stable sort
+// of all tracks concatenated would give
+static inline uint64_t merge_key(const struct bm_event *event, int index)
+{
+    return ((uint64_t)(uint32_t)event->pos << 32) | ((uint64_t)event->type << 24) | index;
+}
+
+static void sift_down(uint64_t *heap, int n, int i)
+{
+    uint64_t x = heap[i];
+    while (true) {
+        int c = i * 2 + 1;
+        if (c >= n) break;
+        if (c + 1 < n && heap[c + 1] < heap[c]) c++;
+        if (heap[c] >= x) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = x;
+}
+
+// `heap` has room for `count` keys; returns the number of events
+static int merge_cursors(struct seq_cursor *cursors, int count,
+    const struct seq_layout *l, uint64_t *heap, struct bm_event *dst)
+{
+    const struct bm_event *start = dst;
+    int n = 0;
+    for (int i = 0; i < count; i++)
+        if (read_cursor(&cursors[i], l))
+            heap[n++] = merge_key(&cursors[i].event, i);
+    for (int i = n / 2 - 1; i >= 0; i--) sift_down(heap, n, i);
+
+    while (n > 0) {
+        int i = (int)(heap[0] & 0xffffff);
+        *(dst++) = cursors[i].event;
+        if (read_cursor(&cursors[i], l))
+            heap[0] = merge_key(&cursors[i].event, i);
+        else
+            heap[0] = heap[--n];
+        sift_down(heap, n, 0);
+    }
+    return (int)(dst - start);
+}
+
+static inline bool is_lane_event(const struct bm_event *event)
+{
+    return event->type == BM_NOTE || event->type == BM_NOTE_LONG ||
+        event->type == BM_NOTE_OFF;
+}
+
+// Counting sort of note events by lane, which keeps each lane in order;
+// the offsets are stored after the events in the same allocation
+static void split_lanes(struct bm_seq *seq)
+{
+    int count[BM_LANE_COUNT + 1] = { 0 };
+    int total = 0;
+    for (int i = 0; i < seq->event_count; i++)
+        if (is_lane_event(&seq->events[i])) {
+            count[bm_lane(seq->events[i].track)]++;
+            total++;
+        }
+
+    seq->lane_events = (struct bm_event *)mem_alloc(seq->alloc,
+        total * sizeof(struct bm_event) + (BM_LANE_COUNT + 1) * sizeof(int));
+    if (seq->lane_events == NULL) return;
+    seq->lane_start = (int *)(seq->lane_events + total);
+
+    for (int l = 0, sum = 0; l <= BM_LANE_COUNT; l++) {
+        seq->lane_start[l] = sum;
+        sum += count[l];
+        count[l] = seq->lane_start[l];
+    }
+    for (int i = 0; i < seq->event_count; i++)
+        if (is_lane_event(&seq->events[i]))
+            seq->lane_events[count[bm_lane(seq->events[i].track)]++] = seq->events[i];
+}
+
+// All columns share one allocation, ordered by alignment
+static void split_columns(struct bm_seq *seq)
+{
+    int n = seq->event_count;
+    struct bm_seq_columns *c = &seq->columns;
+    char *p = (char *)mem_alloc(seq->alloc, n * (sizeof(int) * 2 + sizeof(float) +
+        sizeof(short) + sizeof(unsigned char) + sizeof(signed char)));
+    if (p == NULL) return;
+
+    c->pos = (int *)p;
+    c->value_f = (float *)(c->pos + n);
+    c->value_a = (int *)(c->value_f + n);
+    c->value = (short *)(c->value_a + n);
+    c->type = (unsigned char *)(c->value + n);
+    c->track = (signed char *)(c->type + n);
+
+    for (int i = 0; i < n; i++) {
+        const struct bm_event *ev = &seq->events[i];
+        c->pos[i] = ev->pos;
+        c->type[i] = ev->type;
+        c->track[i] = ev->track;
+        bool tempo = (ev->type == BM_TEMPO_CHANGE);
+        c->value_f[i] = (tempo ? ev->value_f : 0);
+        c->value[i] = (tempo ? 0 : ev->value);
+        c->value_a[i] = (tempo ? 0 : ev->value_a);
+    }
+}
+
+void bm_to_seq_ex(struct bm_chart *chart, struct bm_seq *seq,
+    int resolution, int flags)
+{
+    memset(seq, 0, sizeof(struct bm_seq));
+    seq->alloc = (chart->arena != NULL ? chart->arena->alloc : default_allocator);
+
+    int bar_count = 0, beats = 0;
+    while (bar_count < BM_BARS_COUNT && chart->tracks.time_sig[bar_count] != 0)
+        beats += chart->tracks.time_sig[bar_count++];
+    if (bar_count < BM_BARS_COUNT) bar_count++;
+
+    int res = (resolution > 0 ? resolution : auto_resolution(chart, beats));
+    bool nearest = !(flags & BM_SEQ_TRUNCATE);
+    seq->resolution = res;
+
+    // Every note yields one event, except that a long note yields
+    // none for its start and two for its end
+    int total = bar_count;
+    int long_total = 0;
+    total += chart->tracks.tempo.note_count + chart->tracks.ex_tempo.note_count +
+        chart->tracks.bga_base.note_count + chart->tracks.bga_layer.note_count +
+        chart->tracks.bga_poor.note_count + chart->tracks.stop.note_count;
+    for (int i = 0; i < chart->tracks.background_count; i++)
+        total += chart->tracks.background[i].note_count;
+    for (int i = 0; i < 60; i++) {
+        total += chart->tracks.object[i].note_count;
+        for (int j = 0; j < chart->tracks.object[i].note_count; j++)
+            long_total += (chart->tracks.object[i].notes[j].value == -1);
+    }
+
+    // The cursors, followed by the heap for merging
+    int track_count = FIXED_TRACKS + chart->tracks.background_count;
+    struct seq_cursor *cursors = (track_count > MAX_TRACKS ? NULL : (struct seq_cursor *)
+        mem_alloc(seq->alloc, track_count * (sizeof(struct seq_cursor) + sizeof(uint64_t))));
+    seq->events = (struct bm_event *)
+        mem_alloc(seq->alloc, total * sizeof(struct bm_event));
+    if (long_total > 0)
+        seq->long_notes = (struct bm_event *)
+            mem_alloc(seq->alloc, long_total * sizeof(struct bm_event));
+    if (cursors == NULL || seq->events == NULL ||
+        (long_total > 0 && seq->long_notes == NULL))
+    {
+        mem_free(seq->alloc, cursors);
+        bm_close_seq(seq);
+        return;
+    }
+
+    int bar_start[BM_BARS_COUNT];
+    for (int i = 0, beats = 0; i < bar_count; i++) {
+        bar_start[i] = beats;
+        beats += chart->tracks.time_sig[i];
+    }
+    struct seq_layout layout = { chart, bar_start, bar_count, res, nearest };
+
+    // In the order of the tracks' events on ties
+    struct bm_tracks *t = &chart->tracks;
+    struct seq_cursor *c = cursors;
+    open_cursor(c++, &layout, CURSOR_BARLINE, NULL, BM_BARLINE, 0);
+    open_cursor(c++, &layout, CURSOR_TEMPO, &t->tempo, BM_TEMPO_CHANGE, 3);
+    open_cursor(c++, &layout, CURSOR_EX_TEMPO, &t->ex_tempo, BM_TEMPO_CHANGE, 8);
+    open_cursor(c++, &layout, CURSOR_PLAIN, &t->bga_base, BM_BGA_BASE_CHANGE, 4);
+    open_cursor(c++, &layout, CURSOR_PLAIN, &t->bga_layer, BM_BGA_LAYER_CHANGE, 7);
+    open_cursor(c++, &layout, CURSOR_PLAIN, &t->bga_poor, BM_BGA_POOR_CHANGE, 6);
+    open_cursor(c++, &layout, CURSOR_STOP, &t->stop, BM_STOP, 9);
+    for (int i = 0; i < t->background_count; i++)
+        open_cursor(c++, &layout, CURSOR_PLAIN, &t->background[i], BM_NOTE,
+            -(i < BM_BGM_TRACKS ? i : BM_BGM_TRACKS - 1));
+    for (int i = 0; i < 60; i++)
+        open_cursor(c++, &layout, CURSOR_OBJECT, &t->object[i], BM_NOTE,
+            (i + 10 >= 50 ? i - 30 : i + 10));
+
+    seq->event_count = merge_cursors(cursors, track_count, &layout,
+        (uint64_t *)(cursors + track_count), seq->events);
+    mem_free(seq->alloc, cursors);
+
+    // Collect long notes
+    for (int i = 0; i < seq->event_count; i++)
+        if (seq->events[i].type == BM_NOTE_LONG)
+            seq->long_notes[seq->long_note_count++] = seq->events[i];
+
+    if (flags & BM_SEQ_LANES) split_lanes(seq);
+    if (flags & BM_SEQ_SOA) split_columns(seq);
+}
+
+void bm_to_seq(struct bm_chart *chart, struct bm_seq *seq)
+{
+    bm_to_seq_ex(chart, seq, 48, 0);
+}
+
+void bm_close_chart(struct bm_chart *chart)
+{
+    // Everything is owned by the arena
+    free_arena(chart->arena);
+    chart->arena = NULL;
+}
+
+void bm_close_seq(struct bm_seq *seq)
+{
+    mem_free(seq->alloc, seq->events);
+    mem_free(seq->alloc, seq->long_notes);
+    mem_free(seq->alloc, seq->lane_events);
+    mem_free(seq->alloc, seq->columns.pos);
+    memset(&seq->columns, 0, sizeof(struct bm_seq_columns));
+    seq->events = seq->long_notes = seq->lane_events = NULL;
+    seq->lane_start = NULL;
+}
+
+// Range queries
+
+int bm_find_event(const struct bm_seq *seq, int pos)
+{
+    int lo = -1, hi = seq->event_count;
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (seq->events[mid].pos < pos) lo = mid; else hi = mid;
+    }
+    return hi;
+}
+
+// The subtree under index `mid` of [lo, hi) covers [lo, mid) and [mid + 1, hi)
+static int build_max_end(const int *end, int *max_end, int lo, int hi)
+{
+    if (lo >= hi) return INT_MIN;
+    int mid = lo + (hi - lo) / 2;
+    int m = end[mid];
+    int l = build_max_end(end, max_end, lo, mid);
+    int r = build_max_end(end, max_end, mid + 1, hi);
+    if (m < l) m = l;
+    if (m < r) m = r;
+    return (max_end[mid] = m);
+}
+
+int bm_build_index(struct bm_seq_index *index, const struct bm_seq *seq)
+{
+    int n = seq->long_note_count;
+    index->seq = seq;
+    index->alloc = seq->alloc;
+    index->ln_end = index->ln_max_end = NULL;
+    if (n == 0) return 0;
+
+    index->ln_end = (int *)mem_alloc(index->alloc, n * 2 * sizeof(int));
+    if (index->ln_end == NULL) return -1;
+    index->ln_max_end = index->ln_end + n;
+
+    // Ends are the positions of the matching BM_NOTE_OFF events: on the same
+    // lane, the open long note with the same start and duration, or else the
+    // earliest one; long notes are in the order their starts appear
+    int head[BM_LANE_COUNT], tail[BM_LANE_COUNT];
+    int *next = index->ln_max_end;  // Until the tree is built
+    for (int l = 0; l < BM_LANE_COUNT; l++) head[l] = -1;
+    for (int i = 0; i < n; i++) index->ln_end[i] = seq->long_notes[i].pos;
+    for (int i = 0, k = 0; i < seq->event_count; i++) {
+        const struct bm_event *ev = &seq->events[i];
+        if (ev->type != BM_NOTE_LONG && ev->type != BM_NOTE_OFF) continue;
+        int l = bm_lane(ev->track);
+        if (ev->type == BM_NOTE_LONG) {
+            if (k == n) continue;
+            next[k] = -1;
+            if (head[l] == -1) head[l] = k; else next[tail[l]] = k;
+            tail[l] = k++;
+        } else if (head[l] != -1) {
+            int64_t start = (int64_t)ev->pos - ev->value_a;
+            int prev = -1, j = head[l];
+            while (j != -1 && (seq->long_notes[j].pos != start ||
+                seq->long_notes[j].value_a != ev->value_a))
+            {
+                prev = j;
+                j = next[j];
+            }
+            if (j == -1) { prev = -1; j = head[l]; }
+            index->ln_end[j] = ev->pos;
+            if (prev == -1) head[l] = next[j]; else next[prev] = next[j];
+            if (tail[l] == j) tail[l] = prev;
+        }
+    }
+    build_max_end(index->ln_end, index->ln_max_end, 0, n);
+    return 0;
+}
+
+void bm_close_index(struct bm_seq_index *index)
+{
+    mem_free(index->alloc, index->ln_end);
+    index->ln_end = index->ln_max_end = NULL;
+}
+
+// Subtrees whose ends all fall before t0 are skipped, as are right
+// subtrees once a start lies past t1
+static int query_long_notes(const struct bm_seq_index *index, int lo, int hi,
+    int t0, int t1, int *out, int cap, int count)
+{
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (index->ln_max_end[mid] < t0) break;
+        count = query_long_notes(index, lo, mid, t0, t1, out, cap, count);
+        if (index->seq->long_notes[mid].pos > t1) break;
+        if (index->ln_end[mid] >= t0) {
+            if (count < cap) out[count] = mid;
+            count++;
+        }
+        lo = mid + 1;
+    }
+    return count;
+}
+
+int bm_query_long_notes(const struct bm_seq_index *index, int t0, int t1,
+    int *out, int cap)
+{
+    return query_long_notes(index, 0, index->seq->long_note_count, t0, t1, out, cap, 0);
+}
+
+void bm_cursor_init(struct bm_seq_cursor *cursor, const struct bm_seq *seq)
+{
+    cursor->seq = seq;
+    cursor->lo = cursor->hi = 0;
+    cursor->t0 = cursor->t1 = INT_MIN;
+}
+
+int bm_cursor_seek(struct bm_seq_cursor *cursor, int t0, int t1)
+{
+    const struct bm_seq *seq = cursor->seq;
+    int n = seq->event_count;
+
+    if (t0 < cursor->t0) {
+        cursor->lo = bm_find_event(seq, t0);
+    } else {
+        while (cursor->lo < n && seq->events[cursor->lo].pos < t0) cursor->lo++;
+    }
+    if (t1 < cursor->t1) {
+        cursor->hi = (t1 == INT_MAX ? n : bm_find_event(seq, t1 + 1));
+    } else {
+        while (cursor->hi < n && seq->events[cursor->hi].pos <= t1) cursor->hi++;
+    }
+    if (cursor->hi < cursor->lo) cursor->hi = cursor->lo;
+
+    cursor->t0 = t0;
+    cursor->t1 = t1;
+    return cursor->hi - cursor->lo;
+}
+
+// Timing
+
+int bm_build_timing(struct bm_timing *timing, const struct bm_seq *seq, float init_tempo)
+{
+    timing->alloc = seq->alloc;
+    timing->resolution = seq->resolution;
+    timing->seg_count = 0;
+
+    int cap = 1;
+    for (int i = 0; i < seq->event_count; i++)
+        cap += (seq->events[i].type == BM_TEMPO_CHANGE || seq->events[i].type == BM_STOP);
+    timing->segs = (struct bm_timing_seg *)
+        mem_alloc(timing->alloc, cap * sizeof(struct bm_timing_seg));
+    if (timing->segs == NULL) return -1;
+
+    struct bm_timing_seg *seg = timing->segs;
+    double beat_seconds = 60.0 / (init_tempo > 0 ? init_tempo : 130);
+    seg->tick = 0;
+    seg->tempo = (init_tempo > 0 ? init_tempo : 130);
+    seg->seconds = 0;
+    seg->spt = beat_seconds / seq->resolution;
+
+    for (int i = 0; i < seq->event_count; i++) {
+        const struct bm_event *ev = &seq->events[i];
+        if (ev->type == BM_TEMPO_CHANGE && ev->value_f > 0) {
+            beat_seconds = 60.0 / ev->value_f;
+            seg[1].tempo = ev->value_f;
+        } else if (ev->type == BM_STOP && ev->value > 0) {
+            seg[1].tempo = seg->tempo;
+        } else {
+            continue;
+        }
+        seg[1].tick = ev->pos;
+        seg[1].seconds = seg->seconds + (double)(ev->pos - seg->tick) * seg->spt;
+        seg[1].spt = beat_seconds / seq->resolution;
+        // Stops are in 48ths of a beat at the current tempo
+        if (ev->type == BM_STOP) seg[1].seconds += ev->value * beat_seconds / 48;
+        seg++;
+    }
+
+    timing->seg_count = seg - timing->segs + 1;
+    return 0;
+}
+
+void bm_close_timing(struct bm_timing *timing)
+{
+    mem_free(timing->alloc, timing->segs);
+    timing->segs = NULL;
+    timing->seg_count = 0;
+}
+
+// Last segment starting before `tick`, or the first one
+static inline const struct bm_timing_seg *seg_before(
+    const struct bm_timing *timing, double tick)
+{
+    int lo = 0, hi = timing->seg_count;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (timing->segs[mid].tick < tick) lo = mid; else hi = mid;
+    }
+    return &timing->segs[lo];
+}
+
+double bm_tick_to_seconds(const struct bm_timing *timing, double tick)
+{
+    const struct bm_timing_seg *seg = seg_before(timing, tick);
+    return seg->seconds + (tick - seg->tick) * seg->spt;
+}
+
+double bm_seconds_to_tick(const struct bm_timing *timing, double seconds)
+{
+    int lo = 0, hi = timing->seg_count;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (timing->segs[mid].seconds <= seconds) lo = mid; else hi = mid;
+    }
+    const struct bm_timing_seg *seg = &timing->segs[lo];
+    double tick = seg->tick + (seconds - seg->seconds) / seg->spt;
+    // Within a stop, which starts where the next segment does
+    if (lo + 1 < timing->seg_count && tick > seg[1].tick) tick = seg[1].tick;
+    return tick;
+}
+
+float bm_tempo_at(const struct bm_timing *timing, double tick)
+{
+    int lo = 0, hi = timing->seg_count;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (timing->segs[mid].tick <= tick) lo = mid; else hi = mid;
+    }
+    return timing->segs[lo].tempo;
+}
+
+// Times of events that all lie within one segment
+static inline void segment_times(const struct bm_timing_seg *seg,
+    const struct bm_event *events, int n, double *seconds)
+{
+    int i = 0;
+#ifdef BM_SSE2
+    const __m128d base = _mm_set1_pd(seg->seconds), spt = _mm_set1_pd(seg->spt);
+    for (; i + 2 <= n; i += 2) {
+        __m128d ticks = _mm_cvtepi32_pd(_mm_set_epi32(0, 0,
+            events[i + 1].pos - seg->tick, events[i].pos - seg->tick));
+        _mm_storeu_pd(seconds + i, _mm_add_pd(base, _mm_mul_pd(ticks, spt)));
+    }
+#endif
+    for (; i < n; i++)
+        seconds[i] = seg->seconds + (double)(events[i].pos - seg->tick) * seg->spt;
+}
+
+void bm_event_times(const struct bm_timing *timing, const struct bm_seq *seq,
+    double *seconds)
+{
+    const struct bm_timing_seg *seg = timing->segs;
+    const struct bm_timing_seg *last = seg + timing->seg_count - 1;
+    const struct bm_event *events = seq->events;
+    int n = seq->event_count;
+
+    for (int i = 0, j; i < n; i = j) {
+        while (seg < last && seg[1].tick < events[i].pos) seg++;
+        // Events up to the start of the next segment belong to this one
+        if (seg == last) {
+            j = n;
+        } else {
+            for (j = i + 1; j < n && events[j].pos <= seg[1].tick; j++) { }
+        }
+        segment_times(seg, events + i, j - i, seconds + i);
+    }
+}
+
+// Batch loading
+
+static double now_seconds()
+{
+#if defined(CLOCK_MONOTONIC) && !defined(_WIN32)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static void run_job(struct bm_load_job *job, int flags)
+{
+    double start = now_seconds();
+    bm_init_ctx(&job->ctx);
+    job->ctx.alloc = job->alloc;
+    if (job->path != NULL)
+        job->result = bm_load_file_ctx(&job->ctx, &job->chart, job->path, flags);
+    else
+        job->result = bm_load_ctx(&job->ctx, &job->chart, job->source, job->len, flags);
+    if (job->result != -1 && job->to_seq) bm_to_seq(&job->chart, &job->seq);
+    job->seconds = now_seconds() - start;
+}
+
+// Jobs are dealt out largest first so that big charts do not end up
+// being started last while the other workers run out of work
+struct job_order {
+    size_t size;
+    int index;
+};
+
+static int job_size_compare(const void *_lhs, const void *_rhs)
+{
+    const struct job_order *lhs = (const struct job_order *)_lhs;
+    const struct job_order *rhs = (const struct job_order *)_rhs;
+    if (lhs->size != rhs->size) return lhs->size < rhs->size ? 1 : -1;
+    return lhs->index - rhs->index;
+}
+
+static int double_compare(const void *_lhs, const void *_rhs)
+{
+    double lhs = *(const double *)_lhs, rhs = *(const double *)_rhs;
+    return (lhs < rhs ? -1 : (lhs > rhs ? +1 : 0));
+}
+
+#ifdef BM_THREADS
+// Each worker owns a slice of the job order and takes from its front;
+// idle workers steal from the back of the others' slices
+struct worker_deque {
+    pthread_mutex_t lock;
+    int head, tail;
+};
+
+struct batch {
+    struct bm_load_job *jobs;
+    int *slots;
+    struct worker_deque *deques;
+    int worker_count;
+    int flags;
+};
+
+struct worker {
+    struct batch *batch;
+    int id;
+};
+
+static int take_job(struct batch *b, int id)
+{
+    struct worker_deque *d = &b->deques[id];
+    int index = -1;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) index = b->slots[d->head++];
+    pthread_mutex_unlock(&d->lock);
+    if (index != -1) return index;
+
+    for (int i = 1; i < b->worker_count && index == -1; i++) {
+        d = &b->deques[(id + i) % b->worker_count];
+        pthread_mutex_lock(&d->lock);
+        if (d->head < d->tail) index = b->slots[--d->tail];
+        pthread_mutex_unlock(&d->lock);
+    }
+    return index;
+}
+
+static void *worker_main(void *_w)
+{
+    struct worker *w = (struct worker *)_w;
+    int index;
+    while ((index = take_job(w->batch, w->id)) != -1)
+        run_job(&w->batch->jobs[index], w->batch->flags);
+    return NULL;
+}
+
+static int default_thread_count()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n >= 1 ? (int)n : 1);
+}
+#endif
+
+int bm_load_many(struct bm_load_job *jobs, int count,
+    int threads, int flags, struct bm_batch_stats *stats)
+{
+    // Scratch memory comes from the default allocator
+    const struct bm_allocator *alloc = default_allocator;
+    struct job_order *order = (struct job_order *)
+        mem_alloc(alloc, (count > 0 ? count : 1) * sizeof(struct job_order));
+    double *latency = (double *)
+        mem_alloc(alloc, (count > 0 ? count : 1) * sizeof(double));
+    if (order == NULL || latency == NULL) {
+        mem_free(alloc, order);
+        mem_free(alloc, latency);
+        return -1;
+    }
+
+    size_t bytes = 0;
+    for (int i = 0; i < count; i++) {
+        order[i].index = i;
+        order[i].size = jobs[i].len;
+    #ifndef _WIN32
+        struct stat st;
+        if (jobs[i].path != NULL)
+            order[i].size = (stat(jobs[i].path, &st) == 0 ? st.st_size : 0);
+    #endif
+        bytes += order[i].size;
+    }
+    qsort(order, count, sizeof(struct job_order), job_size_compare);
+
+    double start = now_seconds();
+
+#ifdef BM_THREADS
+    if (threads <= 0) threads = default_thread_count();
+    if (threads > count) threads = count;
+#else
+    threads = 1;
+#endif
+
+    if (threads <= 1) {
+        for (int i = 0; i < count; i++) run_job(&jobs[order[i].index], flags);
+#ifdef BM_THREADS
+    } else {
+        int *slots = (int *)mem_alloc(alloc, count * sizeof(int));
+        struct worker_deque *deques = (struct worker_deque *)
+            mem_alloc(alloc, threads * sizeof(struct worker_deque));
+        struct worker *workers = (struct worker *)
+            mem_alloc(alloc, threads * sizeof(struct worker));
+        pthread_t *tids = (pthread_t *)mem_alloc(alloc, threads * sizeof(pthread_t));
+
+        if (slots == NULL || deques == NULL || workers == NULL || tids == NULL) {
+            mem_free(alloc, slots);
+            mem_free(alloc, deques);
+            mem_free(alloc, workers);
+            mem_free(alloc, tids);
+            mem_free(alloc, order);
+            mem_free(alloc, latency);
+            return -1;
+        }
+
+        // Deal round-robin so that every slice is also sorted by size
+        for (int t = 0, p = 0; t < threads; t++) {
+            deques[t].head = p;
+            for (int i = t; i < count; i += threads) slots[p++] = order[i].index;
+            deques[t].tail = p;
+            pthread_mutex_init(&deques[t].lock, NULL);
+        }
+
+        struct batch b = { jobs, slots, deques, threads, flags };
+        int started = 0;
+        for (int t = 1; t < threads; t++) {
+            workers[t].batch = &b;
+            workers[t].id = t;
+            if (pthread_create(&tids[t], NULL, worker_main, &workers[t]) != 0) break;
+            started = t;
+        }
+        // The calling thread works as well; jobs of workers that failed
+        // to start are taken over by stealing
+        workers[0].batch = &b;
+        workers[0].id = 0;
+        worker_main(&workers[0]);
+        for (int t = 1; t <= started; t++) pthread_join(tids[t], NULL);
+
+        for (int t = 0; t < threads; t++) pthread_mutex_destroy(&deques[t].lock);
+        mem_free(alloc, slots);
+        mem_free(alloc, deques);
+        mem_free(alloc, workers);
+        mem_free(alloc, tids);
+#endif
+    }
+
+    double wall = now_seconds() - start;
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        latency[i] = jobs[i].seconds;
+        if (jobs[i].result == -1) failed++;
+    }
+
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(struct bm_batch_stats));
+        stats->job_count = count;
+        stats->failed_count = failed;
+        stats->thread_count = threads;
+        stats->bytes = bytes;
+        stats->wall_seconds = wall;
+        if (wall > 0) {
+            stats->bytes_per_second = bytes / wall;
+            stats->jobs_per_second = count / wall;
+        }
+        if (count > 0) {
+            qsort(latency, count, sizeof(double), double_compare);
+            double sum = 0;
+            for (int i = 0; i < count; i++) sum += latency[i];
+            stats->latency_mean = sum / count;
+            stats->latency_min = latency[0];
+            stats->latency_p50 = latency[(count - 1) / 2];
+            stats->latency_p99 = latency[(int)((count - 1) * 0.99)];
+            stats->latency_max = latency[count - 1];
+        }
+    }
+
+    mem_free(alloc, order);
+    mem_free(alloc, latency);
+    return failed;
+}
+
+void bm_close_job(struct bm_load_job *job)
+{
+    if (job->result != -1) {
+        bm_close_chart(&job->chart);
+        if (job->to_seq) bm_close_seq(&job->seq);
+    }
+    bm_close_ctx(&job->ctx);
 }
 
 /*
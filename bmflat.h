@@ -1,6 +1,8 @@
 #ifndef _BMFLAT_H_
 #define _BMFLAT_H_
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -34,6 +36,10 @@ struct bm_note {
     short bar:15;
     short hold:1;
     short value;
+    // Exact position: `num` out of `den` equal divisions of the bar,
+    // where `den` is the number of entries in the line
+#define BM_MAX_DIVISIONS    65535
+    unsigned short num, den;
 };
 
 struct bm_track {
@@ -45,9 +51,9 @@ struct bm_tracks {
 #define BM_BARS_COUNT   1000
     unsigned char time_sig[BM_BARS_COUNT];
 
-#define BM_BGM_TRACKS   64
+    // As many as the most background lines in any one bar
     int background_count;
-    struct bm_track background[BM_BGM_TRACKS];
+    struct bm_track *background;
     struct bm_track object[60];
 
     struct bm_track tempo;
@@ -58,60 +64,492 @@ struct bm_tracks {
     struct bm_track stop;
 };
 
+// Memory allocation
+// Every allocation made by bmflat goes through one of these hooks;
+// `realloc_fn` is given NULL to allocate and `free_fn` is never given NULL
+struct bm_allocator {
+    void *(*alloc_fn)(void *user, size_t size);
+    void *(*realloc_fn)(void *user, void *ptr, size_t size);
+    void (*free_fn)(void *user, void *ptr);
+    void *user;
+};
+
+// Sets the allocator used wherever none is given; NULL restores malloc/free
+// Not thread-safe; call before anything is loaded
+void bm_set_allocator(const struct bm_allocator *alloc);
+
+struct bm_arena;
+
+// Of the raw bytes of the source
+struct bm_digests {
+    unsigned char md5[16];
+    unsigned char sha256[32];
+};
+
 struct bm_chart {
     struct bm_metadata meta;
     struct bm_tables tables;
     struct bm_tracks tracks;
+    struct bm_digests digests;  // All zeros unless loaded with BM_LOAD_DIGESTS
+    struct bm_arena *arena; // Owns all strings and notes
 };
 
+// value_a is zero for types that do not list it
 enum bm_event_type {
     BM_BARLINE = 0,         // value = index, value_a = time signature
     BM_TEMPO_CHANGE,        // value_f = BPM
     BM_BGA_BASE_CHANGE,     // value = index
     BM_BGA_LAYER_CHANGE,    // value = index
     BM_BGA_POOR_CHANGE,     // value = index
-    BM_STOP,                // value = duration
+    BM_STOP,                // value = duration in 48ths of a beat
     BM_NOTE,                // value = index
     BM_NOTE_LONG,           // value = index, value_a = duration
     BM_NOTE_OFF,            // value = index, value_a = duration
 };
 
 struct bm_event {
-    int pos;    // beat * 48 + fraction in 48ths of a beat (192ths of a whole note)
+    int pos;    // In ticks of 1/resolution of a beat; 192ths of a whole note by default
     enum bm_event_type type:8;
     signed char track;  // non-positive for backgrounds; 11 - 59 for objects
+    short value;
+    // Durations are in ticks, which at fine resolutions exceed a short
     union {
-        struct {
-            short value;
-            short value_a;
-        };
+        int value_a;
         float value_f;
     };
 };
 
+// Background tracks from BM_BGM_TRACKS - 1 onwards all become track
+// -(BM_BGM_TRACKS - 1) in sequences, so that it fits in bm_event
+#define BM_BGM_TRACKS       64
+
+// Lanes are the object tracks 10-49 (long note tracks 51-69 are merged
+// into 11-29), followed by the background tracks 0 to -63
+#define BM_OBJECT_LANES     40
+#define BM_LANE_COUNT       (BM_OBJECT_LANES + BM_BGM_TRACKS)
+#define bm_lane(_track)     ((_track) > 0 ? (_track) - 10 : BM_OBJECT_LANES - (_track))
+
+// The fields of `events` as separate arrays, in the same order
+struct bm_seq_columns {
+    int *pos;
+    float *value_f;     // Zero except for BM_TEMPO_CHANGE
+    short *value;       // Zero for BM_TEMPO_CHANGE
+    int *value_a;       // Zero except for BM_BARLINE, BM_NOTE_LONG and BM_NOTE_OFF
+    unsigned char *type;
+    signed char *track;
+};
+
 struct bm_seq {
+    const struct bm_allocator *alloc;   // Owns the arrays below
+    int resolution; // Ticks per beat
+
     int event_count;
     struct bm_event *events;
 
     int long_note_count;
     struct bm_event *long_notes;
+
+    // With BM_SEQ_LANES, a copy of the note events (BM_NOTE, BM_NOTE_LONG
+    // and BM_NOTE_OFF) grouped by lane, each lane in order of position;
+    // lane l occupies [lane_start[l], lane_start[l + 1]); NULL otherwise
+    struct bm_event *lane_events;
+    int *lane_start;
+
+    // With BM_SEQ_SOA, `events` laid out as columns; all NULL otherwise
+    struct bm_seq_columns columns;
+};
+
+// Diagnostics are kept as codes with their arguments, and only turned
+// into text by bm_log_message()
+enum bm_log_code {
+    // Track data
+    BM_LOG_TOO_MANY_ENTRIES,    // a = the limit
+    BM_LOG_TRAILING_CHAR,       // text = the character
+    BM_LOG_INVALID_PAIR,        // text = the pair, a = its column
+    BM_LOG_TRACK_REDEFINED,     // a = the channel
+    BM_LOG_INEXACT_TIME_SIG,    // a = the length used, in quarters
+    BM_LOG_TIME_SIG_REDEFINED,  // a = the bar
+    BM_LOG_INVALID_TIME_SIG,
+    BM_LOG_UNKNOWN_TRACK,       // text = the channel
+    // Commands
+    BM_LOG_EMPTY_ARGUMENT,
+    BM_LOG_INVALID_INT,         // a, b = the range
+    BM_LOG_INVALID_FLOAT,       // a, b = the range
+    BM_LOG_UNKNOWN_COMMAND,     // text = the name, truncated
+    BM_LOG_COMMAND_REDEFINED,   // text = the name
+    BM_LOG_WAV_REDEFINED,       // text = the index
+    BM_LOG_BMP_REDEFINED,       // text = the index
+    BM_LOG_TEMPO_REDEFINED,     // text = the index
+    BM_LOG_STOP_REDEFINED,      // text = the index
+    BM_LOG_INVALID_INDEX,       // text = the index
+    // Reported with line -1
+    BM_LOG_MISSING_INT,         // text = the name, a = the default
+    BM_LOG_MISSING_STRING,      // text = the name
+    // Random branches
+    BM_LOG_UNMATCHED_CONTROL,   // text = the command
+    BM_LOG_MISSING_ENDIF,       // At the line of the #IF
 };
 
 #define BM_MSG_LEN  128
 
 struct bm_log {
     int line;
-    char message[BM_MSG_LEN];
+    unsigned short code;    // enum bm_log_code
+    int a, b;
+    char text[16];
+};
+
+// Writes the message of `log` into `buf` as snprintf() does, which
+// BM_MSG_LEN bytes are always enough for; returns its length
+int bm_log_message(const struct bm_log *log, char *buf, size_t size);
+
+// Load flags
+// Only fills in metadata and #WAV/#BMP tables; track data lines are skipped
+// without being decoded, and `tracks` is left empty
+#define BM_LOAD_META_ONLY   (1 << 0)
+// Skips #WAV and #BMP definitions
+#define BM_LOAD_NO_TABLES   (1 << 1)
+// With BM_LOAD_META_ONLY, stops at the first track data line or once all
+// metadata has been seen; commands after that point are not read
+#define BM_LOAD_STOP_EARLY  (1 << 2)
+// Disables vectorized scanning; for comparison and debugging
+#define BM_LOAD_SCALAR      (1 << 3)
+// Computes `digests` in the same pass as the lines are scanned
+#define BM_LOAD_DIGESTS     (1 << 4)
+// Keeps no diagnostics, as with a `log_limit` of 0; they are still counted
+#define BM_LOAD_NO_LOGS     (1 << 5)
+
+#define BM_LOG_UNLIMITED    0x7fffffff
+
+// Diagnostics of one parse; contexts are independent of each other,
+// so charts may be loaded concurrently with one context per thread
+struct bm_parse_ctx {
+    int log_count, log_cap;
+    struct bm_log *logs;
+    // At most this many diagnostics are kept in `logs` for each parse;
+    // BM_LOG_UNLIMITED after bm_init_ctx()
+    int log_limit;
+    // Diagnostics of the last parse, including those not kept
+    int log_total;
+    // Used for the logs and for charts loaded with this context;
+    // NULL for the one set with bm_set_allocator()
+    const struct bm_allocator *alloc;
 };
 
+void bm_init_ctx(struct bm_parse_ctx *ctx);
+// Frees the logs; `alloc` is kept and the context can be reused
+void bm_close_ctx(struct bm_parse_ctx *ctx);
+
+// Reentrant loaders; `ctx->logs` is overwritten by each call and
+// the number of diagnostics kept is returned, or -1 if out of memory
+int bm_load_ctx(struct bm_parse_ctx *ctx, struct bm_chart *chart,
+    const char *source, size_t len, int flags);
+int bm_load_file_ctx(struct bm_parse_ctx *ctx, struct bm_chart *chart,
+    const char *path, int flags);
+
+// The functions below store diagnostics in bm_logs, valid until the next call
+// They share global state and must not be called from multiple threads
 extern struct bm_log *bm_logs;
 
 int bm_load(struct bm_chart *chart, const char *source);
+// Parses `len` bytes at `source`, which need not be NUL-terminated
+// The buffer is only read from and is not referenced after returning
+// `flags` is a combination of BM_LOAD_* flags
+int bm_load_n(struct bm_chart *chart, const char *source, size_t len, int flags);
+// Maps the file at `path` (or reads it if it is not a regular file) and parses it
+// Returns -1 with errno set and leaves `chart` untouched if it cannot be read,
+// or -1 with an empty chart if out of memory
+int bm_load_file(struct bm_chart *chart, const char *path);
+
+// Incremental loading: the source is given in chunks of any size as they
+// arrive, and only its incomplete last line is kept between them
+struct bm_stream;
+
+// Same as bm_load_ctx() otherwise; the chart is complete after bm_stream_end()
+// Returns NULL if out of memory
+struct bm_stream *bm_stream_begin(struct bm_parse_ctx *ctx,
+    struct bm_chart *chart, int flags);
+// The chunk is not referenced after returning
+// Returns 0, or -1 if out of memory, after which the rest is ignored
+int bm_stream_feed(struct bm_stream *stream, const char *chunk, size_t len);
+// Parses the last line, finishes the chart and frees the stream
+// Returns the number of diagnostics
+int bm_stream_end(struct bm_stream *stream);
+
+// Callback parsing: lines are reported as they are read, without building
+// a chart, and memory use does not grow with the size of the source
+// Any callback may be NULL; returning non-zero stops after the current line
+// Strings are spans into the source and are not NUL-terminated
+struct bm_sax {
+    void *user;
+    // Lines other than track data, e.g. "#TITLE x" gives "TITLE" and "x"
+    // The value is trimmed and may be empty
+    int (*on_header)(void *user, int line,
+        const char *cmd, int cmd_len, const char *value, int value_len);
+    // Each non-zero pair on a track line "#bbbcc:..." as entry `num` out of
+    // `den`; the channel is read as decimal, so "#00116:" gives channel 16
+    int (*on_channel_pair)(void *user, int line,
+        int bar, int channel, int num, int den, int value);
+    // Track lines of channel 02 (bar length), whose data are not pairs
+    int (*on_channel_text)(void *user, int line,
+        int bar, int channel, const char *text, int len);
+    // Syntax errors in track data, the ones bm_load() reports; `log` is
+    // only valid during the call
+    void (*on_diagnostic)(void *user, const struct bm_log *log);
+};
+
+// Only BM_LOAD_SCALAR is recognized in `flags`
+// Pairs are not decoded, nor their diagnostics produced, if on_channel_pair is NULL
+// Returns the number of diagnostics reported
+int bm_parse_sax(const struct bm_sax *sax, const char *source, size_t len, int flags);
+
+// Random branches: #RANDOM, #SETRANDOM, #ENDRANDOM, #IF, #ELSEIF, #ELSE and
+// #ENDIF are read into a tree once, with all other lines decoded, from which
+// the chart for any choice of random values is loaded without scanning or
+// decoding the source again
+// The loaders above do not follow these commands
+struct bm_branches;
+
+// Only BM_LOAD_SCALAR and BM_LOAD_DIGESTS are recognized in `flags`
+// The source is copied; diagnostics about the commands above go to `ctx`
+// Returns NULL if out of memory
+struct bm_branches *bm_parse_branches(struct bm_parse_ctx *ctx,
+    const char *source, size_t len, int flags);
+void bm_close_branches(struct bm_branches *branches);
+
+// Every #RANDOM in order of appearance, including nested ones,
+// each of which picks a value from 1 to its range; the range is 0 for
+// indices outside [0, bm_random_count())
+int bm_random_count(const struct bm_branches *branches);
+int bm_random_range(const struct bm_branches *branches, int index);
+
+// Loads the chart in which #RANDOM number i picks `values[i]`; the values
+// for those in branches not taken are not read, and NULL picks 1 for all
+// Same as bm_load_ctx() otherwise, with the digests of the whole source
+// if the branches were parsed with BM_LOAD_DIGESTS
+int bm_load_variant(struct bm_parse_ctx *ctx, struct bm_chart *chart,
+    const struct bm_branches *branches, const int *values, int flags);
+
+// Sequence flags
+// Rounds positions that fall between ticks down instead of to the nearest
+#define BM_SEQ_TRUNCATE     (1 << 0)
+// Also fills in `lane_events` and `lane_start`
+#define BM_SEQ_LANES        (1 << 1)
+// Also fills in `columns`
+#define BM_SEQ_SOA          (1 << 2)
+
+// Reentrant; the chart is only read from
+// The sequence is allocated with the allocator the chart was loaded with
+// Positions are computed exactly from the notes' fractions and placed at
+// `resolution` ticks per beat; 0 picks the least resolution at which every
+// note falls on a tick, or 48 if positions would then not fit in an int
+void bm_to_seq_ex(struct bm_chart *chart, struct bm_seq *seq,
+    int resolution, int flags);
+// Same as bm_to_seq_ex(chart, seq, 48, 0)
 void bm_to_seq(struct bm_chart *chart, struct bm_seq *seq);
 
 void bm_close_chart(struct bm_chart *chart);
 void bm_close_seq(struct bm_seq *seq);
 
+// Compact charts
+
+// Only the defined table entries and non-empty tracks of a chart, in one
+// allocation; each table is a sorted array of indices with the values
+// alongside, e.g. `wav[i]` is defined as #WAV for index `wav_index[i]`
+struct bm_compact_chart {
+    const struct bm_allocator *alloc;   // Owns this structure
+    size_t size;    // Bytes used, including this structure
+    struct bm_metadata meta;
+    struct bm_digests digests;
+
+    int wav_count, bmp_count, tempo_count, stop_count;
+    short *wav_index, *bmp_index, *tempo_index, *stop_index;
+    char **wav, **bmp;
+    float *tempo;
+    short *stop;
+
+    int time_sig_count;
+    short *time_sig_bar;
+    unsigned char *time_sig;
+
+    // All background tracks, as in bm_tracks
+    int background_count;
+    struct bm_track *background;
+
+    // Other tracks with notes, identified by the channel (3-9 and 11-69)
+    // and in increasing order of it
+    int track_count;
+    signed char *track_id;
+    struct bm_track *tracks;
+};
+
+// The chart is only read from and may be closed afterwards
+// Allocated with the allocator the chart was loaded with; NULL if out of memory
+struct bm_compact_chart *bm_chart_compact(const struct bm_chart *chart);
+void bm_close_compact(struct bm_compact_chart *compact);
+
+// Lookups in O(log n), returning the same as the tables of bm_chart
+// for undefined entries (NULL, -1 and 0)
+const char *bm_compact_wav(const struct bm_compact_chart *compact, int index);
+const char *bm_compact_bmp(const struct bm_compact_chart *compact, int index);
+float bm_compact_tempo(const struct bm_compact_chart *compact, int index);
+int bm_compact_stop(const struct bm_compact_chart *compact, int index);
+int bm_compact_time_sig(const struct bm_compact_chart *compact, int bar);
+// `id` is as in bm_event, minus the index for background tracks;
+// NULL if the track is empty
+const struct bm_track *bm_compact_track(const struct bm_compact_chart *compact, int id);
+
+// Fills in a chart that refers to the compact one, e.g. for bm_to_seq()
+// It must not outlive `compact`, and bm_close_chart() does nothing to it
+void bm_chart_expand(const struct bm_compact_chart *compact, struct bm_chart *chart);
+
+// Bytes used by a loaded chart, including the structure itself
+size_t bm_chart_memory(const struct bm_chart *chart);
+
+// Compiled charts
+// A parsed chart and its sequence saved in a binary file for the same
+// platform, which is loaded by mapping it and pointing into it
+
+// Identifies the source a compiled chart was made from
+struct bm_source_stamp {
+    unsigned long long size;
+    long long mtime;            // Seconds since the epoch; 0 if unknown
+    unsigned long long hash;    // 64-bit FNV-1a of the contents; 0 if unknown
+};
+
+void bm_stamp_source(struct bm_source_stamp *stamp, const char *source, size_t len);
+// The contents are only read and hashed if `hash` is non-zero
+// Returns -1 with errno set if the file cannot be read
+int bm_stamp_file(struct bm_source_stamp *stamp, const char *path, int hash);
+
+// `seq` may be NULL; lane and column arrays are not saved
+// `source` may be NULL, in which case it is recorded as all zeros
+// Returns -1 with errno set on failure
+int bm_save_compiled(const char *path, const struct bm_chart *chart,
+    const struct bm_seq *seq, const struct bm_source_stamp *source);
+// Fills in `chart` and, if not NULL, `seq` with the contents of the file,
+// which is owned by the chart: bm_close_chart() releases it, so the sequence
+// must be closed first; both may still be modified
+// If `expect` is not NULL, its size and mtime, as well as its hash if non-zero,
+// must match those recorded
+// Returns -1 with errno set and leaves both untouched if the file cannot be
+// read, or with errno set to EINVAL if it is invalid, stale or was
+// written by another version or platform
+int bm_load_compiled(const char *path, struct bm_chart *chart,
+    struct bm_seq *seq, const struct bm_source_stamp *expect);
+
+// Range queries
+
+// Index of the first event at or after `pos`, or event_count if none; O(log n)
+int bm_find_event(const struct bm_seq *seq, int pos);
+
+// Long notes arranged as an implicit interval tree over `seq->long_notes`,
+// which are already sorted by their starts; a long note spans from its
+// pos to that of its BM_NOTE_OFF event
+struct bm_seq_index {
+    const struct bm_seq *seq;
+    const struct bm_allocator *alloc;   // Owns the arrays below
+    int *ln_end;
+    int *ln_max_end;    // Largest end in the subtree under each long note
+};
+
+// The sequence must outlive the index
+// Returns 0, or -1 if out of memory
+int bm_build_index(struct bm_seq_index *index, const struct bm_seq *seq);
+void bm_close_index(struct bm_seq_index *index);
+
+// Stores the indices (into `long_notes`) of long notes overlapping [t0, t1]
+// into `out` in order of their starts, at most `cap` of them
+// Returns the number of such long notes, which may exceed `cap`;
+// takes O(log n + k)
+int bm_query_long_notes(const struct bm_seq_index *index, int t0, int t1,
+    int *out, int cap);
+
+// Tracks a window of events [lo, hi) that moves forward through a sequence,
+// such as the visible range or a judge window
+struct bm_seq_cursor {
+    const struct bm_seq *seq;
+    int lo, hi;
+    int t0, t1;
+};
+
+void bm_cursor_init(struct bm_seq_cursor *cursor, const struct bm_seq *seq);
+// Moves the window to the events within [t0, t1] and returns their count;
+// amortized O(1) per event passed while both ends move forward, and
+// O(log n) when either moves back
+// Events that entered the window are the ones from the previous `hi` on
+int bm_cursor_seek(struct bm_seq_cursor *cursor, int t0, int t1);
+
+// Timing
+// A piecewise-linear map between ticks and seconds, built from the
+// tempo changes and stops of a sequence
+
+struct bm_timing_seg {
+    int tick;       // Start of the segment
+    float tempo;    // BPM
+    double seconds; // Time at `tick`, after any stop there
+    double spt;     // Seconds per tick
+};
+
+struct bm_timing {
+    const struct bm_allocator *alloc;   // Owns `segs`
+    int resolution;
+    int seg_count;
+    struct bm_timing_seg *segs;
+};
+
+// Non-positive tempos and stops are ignored; a non-positive initial
+// tempo is taken as 130, the default for a missing #BPM
+// Returns 0, or -1 if out of memory
+int bm_build_timing(struct bm_timing *timing, const struct bm_seq *seq, float init_tempo);
+void bm_close_timing(struct bm_timing *timing);
+
+// Lookups take O(log n) in the number of segments
+// Events at the position of a stop happen when the stop begins
+double bm_tick_to_seconds(const struct bm_timing *timing, double tick);
+// Times during a stop map to the position of the stop
+double bm_seconds_to_tick(const struct bm_timing *timing, double seconds);
+// Tempo in effect at `tick`, including changes at that position
+float bm_tempo_at(const struct bm_timing *timing, double tick);
+// Fills `seconds` with the time of each event in `seq`, in one pass
+void bm_event_times(const struct bm_timing *timing, const struct bm_seq *seq,
+    double *seconds);
+
+// Batch loading
+
+struct bm_load_job {
+    // Input: a file path, or a buffer if `path` is NULL
+    const char *path;
+    const char *source;
+    size_t len;
+    int to_seq;     // Also converts the chart into `seq` if non-zero
+    const struct bm_allocator *alloc;   // NULL for the default
+
+    // Output; release with bm_close_job()
+    int result;     // Number of diagnostics, -1 if the file cannot be read or out of memory
+    struct bm_parse_ctx ctx;
+    struct bm_chart chart;
+    struct bm_seq seq;
+    double seconds; // Time taken by this job
+};
+
+struct bm_batch_stats {
+    int job_count, failed_count;
+    int thread_count;
+    size_t bytes;
+    double wall_seconds;
+    double bytes_per_second, jobs_per_second;
+    // Per-job times in seconds
+    double latency_min, latency_mean, latency_p50, latency_p99, latency_max;
+};
+
+// Runs all jobs on `threads` workers (0 for one per processor), largest first,
+// with idle workers stealing from busy ones; `stats` may be NULL
+// Returns the number of failed jobs, or -1 if out of memory
+int bm_load_many(struct bm_load_job *jobs, int count,
+    int threads, int flags, struct bm_batch_stats *stats);
+void bm_close_job(struct bm_load_job *job);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,930 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bmflat.h"
+
+struct source {
+    char *buf;
+    size_t len;
+};
+
+static char *read_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+
+    char *buf = NULL;
+
+    do {
+        if (fseek(f, 0, SEEK_END) != 0) break;
+        *len = ftell(f);
+        if (fseek(f, 0, SEEK_SET) != 0) break;
+        if ((buf = (char *)malloc(*len + 1)) == NULL) break;
+        if (*len > 0 && fread(buf, *len, 1, f) != 1) { free(buf); buf = NULL; break; }
+    } while (0);
+
+    fclose(f);
+    return buf;
+}
+
+// Reads all files into memory; returns the number of files read
+static int read_sources(int argc, char *argv[], struct source **srcs, size_t *bytes)
+{
+    *srcs = (struct source *)malloc((argc > 0 ? argc : 1) * sizeof(struct source));
+    *bytes = 0;
+    int count = 0;
+    for (int i = 0; i < argc; i++) {
+        size_t len;
+        char *buf = read_file(argv[i], &len);
+        if (buf == NULL) {
+            fprintf(stderr, "Cannot open %s\n", argv[i]);
+            continue;
+        }
+        (*srcs)[count].buf = buf;
+        (*srcs)[count].len = len;
+        *bytes += len;
+        count++;
+    }
+    return count;
+}
+
+static void free_sources(struct source *srcs, int count)
+{
+    for (int i = 0; i < count; i++) free(srcs[i].buf);
+    free(srcs);
+}
+
+// Parses all sources `reps` times on the calling thread, returns seconds
+static double time_loads(struct source *srcs, int count, int reps, int flags)
+{
+    struct bm_parse_ctx ctx;
+    struct bm_chart chart;
+    bm_init_ctx(&ctx);
+
+    clock_t start = clock();
+    for (int r = 0; r < reps; r++)
+        for (int i = 0; i < count; i++) {
+            bm_load_ctx(&ctx, &chart, srcs[i].buf, srcs[i].len, flags);
+            bm_close_chart(&chart);
+        }
+    double t = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    bm_close_ctx(&ctx);
+    return t;
+}
+
+static int parse_reps(int *argc, char **argv[])
+{
+    int reps = 10;
+    if (*argc >= 2 && strcmp((*argv)[0], "-n") == 0) {
+        reps = atoi((*argv)[1]);
+        if (reps < 1) reps = 1;
+        *argc -= 2;
+        *argv += 2;
+    }
+    return reps;
+}
+
+static void report(const char *name, double t, size_t bytes, int reps, double base)
+{
+    printf("%-24s %8.3f s  %8.2f MiB/s", name, t,
+        t > 0 ? bytes * (double)reps / t / 1048576.0 : 0);
+    if (base > 0 && t > 0) printf("  %5.2fx", base / t);
+    putchar('\n');
+}
+
+static int bench_scan(int argc, char *argv[])
+{
+    int reps = parse_reps(&argc, &argv);
+    struct source *srcs;
+    size_t bytes;
+    int count = read_sources(argc, argv, &srcs, &bytes);
+
+    printf("%d file%s, %.2f MiB, %d repetition%s\n",
+        count, count == 1 ? "" : "s", bytes / 1048576.0,
+        reps, reps == 1 ? "" : "s");
+
+    const int meta = BM_LOAD_META_ONLY | BM_LOAD_NO_TABLES;
+    double t;
+    t = time_loads(srcs, count, reps, meta | BM_LOAD_SCALAR);
+    report("Metadata, scalar", t, bytes, reps, 0);
+    report("Metadata, vectorized", time_loads(srcs, count, reps, meta), bytes, reps, t);
+    t = time_loads(srcs, count, reps, BM_LOAD_SCALAR);
+    report("Full, scalar", t, bytes, reps, 0);
+    double full = time_loads(srcs, count, reps, 0);
+    report("Full, vectorized", full, bytes, reps, t);
+    report("Full, with digests", time_loads(srcs, count, reps, BM_LOAD_DIGESTS),
+        bytes, reps, full);
+
+    free_sources(srcs, count);
+    return 0;
+}
+
+static int bench_memory(int argc, char *argv[])
+{
+    struct source *srcs;
+    size_t bytes;
+    int count = read_sources(argc, argv, &srcs, &bytes);
+
+    struct bm_parse_ctx ctx;
+    bm_init_ctx(&ctx);
+    size_t full = 0, compact = 0;
+    for (int i = 0; i < count; i++) {
+        struct bm_chart chart;
+        bm_load_ctx(&ctx, &chart, srcs[i].buf, srcs[i].len, 0);
+        struct bm_compact_chart *c = bm_chart_compact(&chart);
+        full += bm_chart_memory(&chart);
+        if (c != NULL) compact += c->size;
+        bm_close_compact(c);
+        bm_close_chart(&chart);
+    }
+    bm_close_ctx(&ctx);
+
+    printf("%d chart%s, %.2f MiB of source\n",
+        count, count == 1 ? "" : "s", bytes / 1048576.0);
+    printf("%-24s %10.1f KiB  %8.1f KiB/chart\n", "Loaded",
+        full / 1024.0, count > 0 ? full / 1024.0 / count : 0);
+    printf("%-24s %10.1f KiB  %8.1f KiB/chart  %5.1f%%\n", "Compact",
+        compact / 1024.0, count > 0 ? compact / 1024.0 / count : 0,
+        full > 0 ? compact * 100.0 / full : 0);
+
+    free_sources(srcs, count);
+    return 0;
+}
+
+static int bench_compiled(int argc, char *argv[])
+{
+    int reps = parse_reps(&argc, &argv);
+    const char *cache = "flatbench.bmc";
+    double parse = 0, stamp = 0, reload = 0;
+    int count = 0;
+
+    for (int i = 0; i < argc; i++) {
+        struct bm_chart chart;
+        struct bm_seq seq;
+        struct bm_source_stamp st;
+        if (bm_stamp_file(&st, argv[i], 1) != 0 || bm_load_file(&chart, argv[i]) == -1) {
+            fprintf(stderr, "Cannot open %s\n", argv[i]);
+            continue;
+        }
+        bm_to_seq(&chart, &seq);
+        int ret = bm_save_compiled(cache, &chart, &seq, &st);
+        bm_close_seq(&seq);
+        bm_close_chart(&chart);
+        if (ret != 0) {
+            fprintf(stderr, "Cannot write %s\n", cache);
+            break;
+        }
+        count++;
+
+        clock_t start = clock();
+        for (int r = 0; r < reps; r++) {
+            bm_load_file(&chart, argv[i]);
+            bm_to_seq(&chart, &seq);
+            bm_close_seq(&seq);
+            bm_close_chart(&chart);
+        }
+        parse += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        start = clock();
+        for (int r = 0; r < reps; r++) bm_stamp_file(&st, argv[i], 1);
+        stamp += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        start = clock();
+        for (int r = 0; r < reps; r++) {
+            if (bm_load_compiled(cache, &chart, &seq, &st) != 0) continue;
+            bm_close_seq(&seq);
+            bm_close_chart(&chart);
+        }
+        reload += (double)(clock() - start) / CLOCKS_PER_SEC;
+    }
+    remove(cache);
+
+    printf("%d chart%s, %d repetition%s\n",
+        count, count == 1 ? "" : "s", reps, reps == 1 ? "" : "s");
+    printf("%-24s %8.3f s\n", "Parse and convert", parse);
+    printf("%-24s %8.3f s\n", "Hash sources", stamp);
+    printf("%-24s %8.3f s  %5.2fx\n", "Reload compiled", reload,
+        reload > 0 ? parse / reload : 0);
+    return 0;
+}
+
+// Feeds all sources `reps` times in chunks of `chunk` bytes, returns seconds
+static double time_stream(struct source *srcs, int count, int reps, size_t chunk)
+{
+    struct bm_parse_ctx ctx;
+    struct bm_chart chart;
+    bm_init_ctx(&ctx);
+
+    clock_t start = clock();
+    for (int r = 0; r < reps; r++)
+        for (int i = 0; i < count; i++) {
+            struct bm_stream *st = bm_stream_begin(&ctx, &chart, 0);
+            if (st == NULL) continue;
+            for (size_t p = 0; p < srcs[i].len; p += chunk)
+                bm_stream_feed(st, srcs[i].buf + p,
+                    srcs[i].len - p < chunk ? srcs[i].len - p : chunk);
+            bm_stream_end(st);
+            bm_close_chart(&chart);
+        }
+    double t = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    bm_close_ctx(&ctx);
+    return t;
+}
+
+static int bench_stream(int argc, char *argv[])
+{
+    int reps = parse_reps(&argc, &argv);
+    size_t chunk = 4096;
+    if (argc >= 2 && strcmp(argv[0], "-s") == 0) {
+        chunk = (size_t)atol(argv[1]);
+        if (chunk < 1) chunk = 1;
+        argc -= 2;
+        argv += 2;
+    }
+    struct source *srcs;
+    size_t bytes;
+    int count = read_sources(argc, argv, &srcs, &bytes);
+
+    double t = time_loads(srcs, count, reps, 0);
+    report("Whole buffer", t, bytes, reps, 0);
+    char name[48];
+    snprintf(name, sizeof name, "Chunks of %zu bytes", chunk);
+    report(name, time_stream(srcs, count, reps, chunk), bytes, reps, t);
+
+    free_sources(srcs, count);
+    return 0;
+}
+
+static int count_header(void *user, int line,
+    const char *cmd, int cmd_len, const char *value, int value_len)
+{
+    (void)line; (void)cmd; (void)cmd_len; (void)value; (void)value_len;
+    (*(long *)user)++;
+    return 0;
+}
+
+static int count_pair(void *user, int line,
+    int bar, int channel, int num, int den, int value)
+{
+    (void)line; (void)bar; (void)channel; (void)num; (void)den; (void)value;
+    (*(long *)user)++;
+    return 0;
+}
+
+// Parses all sources `reps` times with callbacks, returns seconds
+static double time_sax(struct source *srcs, int count, int reps,
+    const struct bm_sax *sax)
+{
+    clock_t start = clock();
+    for (int r = 0; r < reps; r++)
+        for (int i = 0; i < count; i++)
+            bm_parse_sax(sax, srcs[i].buf, srcs[i].len, 0);
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static int bench_sax(int argc, char *argv[])
+{
+    int reps = parse_reps(&argc, &argv);
+    struct source *srcs;
+    size_t bytes;
+    int count = read_sources(argc, argv, &srcs, &bytes);
+
+    long headers = 0, pairs = 0;
+    struct bm_sax sax_headers = { &headers, count_header, NULL, NULL, NULL };
+    struct bm_sax sax_pairs = { &pairs, NULL, count_pair, NULL, NULL };
+
+    double t = time_loads(srcs, count, reps, 0);
+    report("Full load", t, bytes, reps, 0);
+    report("Callbacks, headers", time_sax(srcs, count, reps, &sax_headers),
+        bytes, reps, t);
+    report("Callbacks, pairs", time_sax(srcs, count, reps, &sax_pairs),
+        bytes, reps, t);
+    printf("%ld header lines, %ld pairs\n", headers / reps, pairs / reps);
+
+    free_sources(srcs, count);
+    return 0;
+}
+
+// Steps `values` to the next combination of random values; returns 0
+// after the last one
+static int next_variant(const struct bm_branches *br, int *values)
+{
+    for (int i = bm_random_count(br) - 1; i >= 0; i--) {
+        if (values[i] < bm_random_range(br, i)) {
+            values[i]++;
+            return 1;
+        }
+        values[i] = 1;
+    }
+    return 0;
+}
+
+#define MAX_NESTING 64
+
+// Copies the lines of one variant into `out`, following the control
+// commands as bm_parse_branches() does with #RANDOM number i picking
+// `values[i]`, which is what loading a variant without branches parsed
+// beforehand takes; nesting past MAX_NESTING is not followed
+// Returns the length copied
+static size_t filter_variant(const char *src, size_t len, const int *values, char *out)
+{
+    // For each open #IF, whether its current lines are kept, whether an
+    // alternative was taken, whether the lines around it are kept,
+    // the value it tests and the number of random scopes outside it
+    struct { int keep, taken, outer, value, depth; } frames[MAX_NESTING];
+    int scopes[MAX_NESTING];
+    int frame_count = 0, scope_count = 0, random = 0;
+    size_t n = 0;
+
+    for (size_t p = 0, e; p < len; p = e + 1) {
+        for (e = p; e < len && src[e] != '\n' && src[e] != '\r' && src[e] != '\0'; e++) { }
+        int keep = (frame_count == 0 || frames[frame_count - 1].keep);
+
+        size_t q = p;
+        while (q < e && (src[q] == ' ' || src[q] == '\t' || src[q] == '\v' || src[q] == '\f')) q++;
+        const char *cmd = src + q + 1;
+        size_t cmd_len = 0;
+        if (q < e && src[q] == '#')
+            while (q + 1 + cmd_len < e && cmd[cmd_len] > ' ') cmd_len++;
+        // Positive arguments only, as invalid ones match nothing
+        int x = 0;
+        for (q += 1 + cmd_len; q < e && src[q] <= ' '; q++) { }
+        for (; q < e && src[q] >= '0' && src[q] <= '9' && x < 100000000; q++)
+            x = x * 10 + (src[q] - '0');
+
+        #define is(_name) (cmd_len == sizeof(_name) - 1 && memcmp(cmd, _name, cmd_len) == 0)
+        int top = frame_count - 1;
+        if (is("RANDOM")) {
+            int v = (x > 0 ? values[random++] : 0);
+            if (scope_count < MAX_NESTING) scopes[scope_count++] = v;
+        } else if (is("SETRANDOM")) {
+            if (scope_count < MAX_NESTING) scopes[scope_count++] = x;
+        } else if (is("ENDRANDOM")) {
+            if (scope_count > (frame_count > 0 ? frames[top].depth : 0)) scope_count--;
+        } else if (is("IF")) {
+            if (frame_count == MAX_NESTING) continue;
+            top = frame_count++;
+            frames[top].outer = keep;
+            frames[top].value = (scope_count > 0 ? scopes[scope_count - 1] : 0);
+            frames[top].keep = frames[top].taken =
+                (keep && x > 0 && frames[top].value == x);
+            frames[top].depth = scope_count;
+        } else if (is("ELSEIF") || is("ELSE")) {
+            if (frame_count == 0) continue;
+            scope_count = frames[top].depth;
+            frames[top].keep = frames[top].outer && !frames[top].taken &&
+                (cmd_len == 4 || (x > 0 && frames[top].value == x));
+            frames[top].taken |= frames[top].keep;
+        } else if (is("ENDIF")) {
+            if (frame_count == 0) continue;
+            scope_count = frames[top].depth;
+            frame_count--;
+        } else if (keep) {
+            memcpy(out + n, src + p, e - p);
+            n += e - p;
+            out[n++] = '\n';
+        }
+        #undef is
+    }
+    return n;
+}
+
+static int bench_variants(int argc, char *argv[])
+{
+    const int max_variants = 1024;
+    int reps = parse_reps(&argc, &argv);
+    struct source *srcs;
+    size_t bytes;
+    int count = read_sources(argc, argv, &srcs, &bytes);
+
+    struct bm_parse_ctx ctx;
+    struct bm_chart chart;
+    bm_init_ctx(&ctx);
+
+    // Every combination of values, up to `max_variants` per chart
+    long variants = 0;
+    size_t max_len = 0;
+    int *counts = (int *)malloc((count > 0 ? count : 1) * sizeof(int));
+    struct bm_branches **brs = (struct bm_branches **)
+        malloc((count > 0 ? count : 1) * sizeof(struct bm_branches *));
+    for (int i = 0; i < count; i++) {
+        brs[i] = bm_parse_branches(&ctx, srcs[i].buf, srcs[i].len, 0);
+        counts[i] = (brs[i] != NULL ? 1 : 0);
+        for (int k = 0; brs[i] != NULL && k < bm_random_count(brs[i]); k++) {
+            long n = (long)counts[i] * bm_random_range(brs[i], k);
+            counts[i] = (n < max_variants ? (int)n : max_variants);
+        }
+        variants += counts[i];
+        if (max_len < srcs[i].len) max_len = srcs[i].len;
+    }
+
+    // Without branches, each variant is cut out of the source and parsed
+    char *buf = (char *)malloc(max_len + 1);
+    clock_t start = clock();
+    for (int r = 0; r < reps; r++)
+        for (int i = 0; i < count; i++) {
+            if (counts[i] == 0) continue;
+            int *values = (int *)malloc((bm_random_count(brs[i]) + 1) * sizeof(int));
+            for (int k = 0; k < bm_random_count(brs[i]); k++) values[k] = 1;
+            for (int v = 0; v < counts[i]; v++) {
+                size_t len = filter_variant(srcs[i].buf, srcs[i].len, values, buf);
+                bm_load_ctx(&ctx, &chart, buf, len, 0);
+                bm_close_chart(&chart);
+                next_variant(brs[i], values);
+            }
+            free(values);
+        }
+    double t_full = (double)(clock() - start) / CLOCKS_PER_SEC;
+    free(buf);
+    for (int i = 0; i < count; i++) bm_close_branches(brs[i]);
+    free(brs);
+
+    start = clock();
+    for (int r = 0; r < reps; r++)
+        for (int i = 0; i < count; i++) {
+            struct bm_branches *br = bm_parse_branches(&ctx, srcs[i].buf, srcs[i].len, 0);
+            if (br == NULL) continue;
+            int *values = (int *)malloc((bm_random_count(br) + 1) * sizeof(int));
+            for (int k = 0; k < bm_random_count(br); k++) values[k] = 1;
+            for (int v = 0; v < counts[i]; v++) {
+                bm_load_variant(&ctx, &chart, br, values, 0);
+                bm_close_chart(&chart);
+                next_variant(br, values);
+            }
+            free(values);
+            bm_close_branches(br);
+        }
+    double t_branches = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%d chart%s, %ld variants, %d repetition%s\n",
+        count, count == 1 ? "" : "s", variants, reps, reps == 1 ? "" : "s");
+    printf("%-24s %8.3f s  %8.1f variants/s\n", "Filtered, then loaded",
+        t_full, t_full > 0 ? variants * (double)reps / t_full : 0);
+    printf("%-24s %8.3f s  %8.1f variants/s", "Branches parsed once",
+        t_branches, t_branches > 0 ? variants * (double)reps / t_branches : 0);
+    if (t_full > 0 && t_branches > 0) printf("  %5.2fx", t_full / t_branches);
+    putchar('\n');
+
+    bm_close_ctx(&ctx);
+    free(counts);
+    free_sources(srcs, count);
+    return 0;
+}
+
+// Builds a chart with `lines` track lines of 64 notes each, spread over
+// channels 11-19 and consecutive bars; `order` is 0 for bars in order,
+// 1 for reversed and 2 for shuffled, which leaves the notes of each track
+// in as many sorted runs as there are lines
+static struct source synth_chart(int lines, int order)
+{
+    const int per_bar = 9, pairs = 64;
+    int bars = (lines + per_bar - 1) / per_bar;
+    int *bar_order = (int *)malloc(bars * sizeof(int));
+    for (int i = 0; i < bars; i++) bar_order[i] = (order == 1 ? bars - 1 - i : i);
+    srand(1);
+    for (int i = bars - 1; order == 2 && i > 0; i--) {
+        int j = rand() % (i + 1);
+        int t = bar_order[i]; bar_order[i] = bar_order[j]; bar_order[j] = t;
+    }
+
+    struct source src;
+    size_t line_len = 7 + pairs * 2 + 1;
+    src.buf = (char *)malloc(64 + (size_t)lines * line_len + 1);
+    src.len = sprintf(src.buf, "#PLAYER 1\n#BPM 150\n");
+    for (int i = 0; i < lines; i++) {
+        char *p = src.buf + src.len;
+        p += sprintf(p, "#%03d%02d:", bar_order[i / per_bar], 11 + i % per_bar);
+        for (int k = 0; k < pairs; k++) {
+            *(p++) = "123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"[(i + k) % 35];
+            *(p++) = 'Z';
+        }
+        *(p++) = '\n';
+        src.len = p - src.buf;
+    }
+    src.buf[src.len] = '\0';
+    free(bar_order);
+    return src;
+}
+
+static int bench_sort(int argc, char *argv[])
+{
+    int reps = parse_reps(&argc, &argv);
+    int notes = (argc >= 1 ? atoi(argv[0]) : 0);
+    if (notes <= 0) notes = 200000;
+    // Bar numbers have three digits
+    int lines = (notes + 63) / 64;
+    if (lines > 9000) lines = 9000;
+
+    printf("%d notes in %d lines, %d repetition%s\n",
+        lines * 64, lines, reps, reps == 1 ? "" : "s");
+
+    static const char *names[] = { "Bars in order", "Bars reversed", "Bars shuffled" };
+    double base = 0;
+    for (int order = 0; order < 3; order++) {
+        struct source src = synth_chart(lines, order);
+        double t = time_loads(&src, 1, reps, 0);
+        if (order == 0) base = t;
+        report(names[order], t, src.len, reps, base);
+        free(src.buf);
+    }
+    return 0;
+}
+
+static int bench_seq(int argc, char *argv[])
+{
+    int reps = parse_reps(&argc, &argv);
+    struct source *srcs;
+    size_t bytes;
+    int count = read_sources(argc, argv, &srcs, &bytes);
+
+    struct bm_parse_ctx ctx;
+    struct bm_chart *charts = (struct bm_chart *)
+        malloc((count > 0 ? count : 1) * sizeof(struct bm_chart));
+    bm_init_ctx(&ctx);
+    for (int i = 0; i < count; i++)
+        bm_load_ctx(&ctx, &charts[i], srcs[i].buf, srcs[i].len, 0);
+    bm_close_ctx(&ctx);
+
+    long events = 0;
+    clock_t start = clock();
+    for (int r = 0; r < reps; r++)
+        for (int i = 0; i < count; i++) {
+            struct bm_seq seq;
+            bm_to_seq(&charts[i], &seq);
+            events += seq.event_count;
+            bm_close_seq(&seq);
+        }
+    double t = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%d chart%s, %ld events, %d repetition%s\n",
+        count, count == 1 ? "" : "s", events / reps, reps, reps == 1 ? "" : "s");
+    printf("%-24s %8.3f s  %8.2f M events/s\n", "Conversion", t,
+        t > 0 ? events / t / 1e6 : 0);
+
+    for (int i = 0; i < count; i++) bm_close_chart(&charts[i]);
+    free(charts);
+    free_sources(srcs, count);
+    return 0;
+}
+
+static int bench_timing(int argc, char *argv[])
+{
+    int reps = parse_reps(&argc, &argv);
+    struct source *srcs;
+    size_t bytes;
+    int count = read_sources(argc, argv, &srcs, &bytes);
+
+    struct bm_parse_ctx ctx;
+    bm_init_ctx(&ctx);
+    double t_build = 0, t_fill = 0, t_lookup = 0, checksum = 0;
+    long events = 0, lookups = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct bm_chart chart;
+        struct bm_seq seq;
+        struct bm_timing timing;
+        bm_load_ctx(&ctx, &chart, srcs[i].buf, srcs[i].len, 0);
+        bm_to_seq(&chart, &seq);
+        double *seconds = (double *)malloc((seq.event_count + 1) * sizeof(double));
+        int end = (seq.event_count > 0 ? seq.events[seq.event_count - 1].pos : 0);
+
+        clock_t start = clock();
+        for (int r = 0; r < reps; r++) {
+            bm_build_timing(&timing, &seq, chart.meta.init_tempo);
+            if (r + 1 < reps) bm_close_timing(&timing);
+        }
+        t_build += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        start = clock();
+        for (int r = 0; r < reps; r++) bm_event_times(&timing, &seq, seconds);
+        t_fill += (double)(clock() - start) / CLOCKS_PER_SEC;
+        events += (long)seq.event_count * reps;
+
+        // Round trips at pseudo-random positions
+        start = clock();
+        unsigned x = 1;
+        for (int r = 0; r < reps * 10000; r++) {
+            x = x * 1103515245 + 12345;
+            double tick = (double)(x >> 8) / (1 << 24) * end;
+            checksum += bm_seconds_to_tick(&timing, bm_tick_to_seconds(&timing, tick));
+        }
+        t_lookup += (double)(clock() - start) / CLOCKS_PER_SEC;
+        lookups += reps * 20000L;
+
+        free(seconds);
+        bm_close_timing(&timing);
+        bm_close_seq(&seq);
+        bm_close_chart(&chart);
+    }
+    bm_close_ctx(&ctx);
+    free_sources(srcs, count);
+
+    printf("%d chart%s, %d repetition%s (checksum %g)\n",
+        count, count == 1 ? "" : "s", reps, reps == 1 ? "" : "s", checksum);
+    printf("%-24s %8.3f s\n", "Building maps", t_build);
+    printf("%-24s %8.3f s  %8.2f M events/s\n", "Event time column", t_fill,
+        t_fill > 0 ? events / t_fill / 1e6 : 0);
+    printf("%-24s %8.3f s  %8.2f M lookups/s\n", "Lookups", t_lookup,
+        t_lookup > 0 ? lookups / t_lookup / 1e6 : 0);
+    return 0;
+}
+
+// Filtering kernels over both layouts: notes of one track within a range,
+// and notes per beat
+
+static int count_aos(const struct bm_seq *seq, int track, int t0, int t1)
+{
+    int count = 0;
+    for (int i = 0; i < seq->event_count; i++) {
+        const struct bm_event *ev = &seq->events[i];
+        count += (ev->type == BM_NOTE && ev->track == track &&
+            ev->pos >= t0 && ev->pos <= t1);
+    }
+    return count;
+}
+
+static int count_soa(const struct bm_seq *seq, int track, int t0, int t1)
+{
+    const int *pos = seq->columns.pos;
+    const unsigned char *type = seq->columns.type;
+    const signed char *tr = seq->columns.track;
+    int count = 0;
+    for (int i = 0; i < seq->event_count; i++)
+        count += (type[i] == BM_NOTE) & (tr[i] == track) & (pos[i] >= t0) & (pos[i] <= t1);
+    return count;
+}
+
+// Events are sorted, so each beat is a contiguous range to count over
+static void density_aos(const struct bm_seq *seq, int *hist, int buckets)
+{
+    for (int b = 0, i = 0; b < buckets; b++) {
+        int lo = i, end = (b + 1) * seq->resolution;
+        while (i < seq->event_count && seq->events[i].pos < end) i++;
+        int count = 0;
+        for (int j = lo; j < i; j++)
+            count += (seq->events[j].type == BM_NOTE && seq->events[j].track > 0);
+        hist[b] = count;
+    }
+}
+
+static void density_soa(const struct bm_seq *seq, int *hist, int buckets)
+{
+    const int *pos = seq->columns.pos;
+    const unsigned char *type = seq->columns.type;
+    const signed char *tr = seq->columns.track;
+    for (int b = 0, i = 0; b < buckets; b++) {
+        int lo = i, end = (b + 1) * seq->resolution;
+        while (i < seq->event_count && pos[i] < end) i++;
+        int count = 0;
+        for (int j = lo; j < i; j++) count += (type[j] == BM_NOTE) & (tr[j] > 0);
+        hist[b] = count;
+    }
+}
+
+static int bench_layout(int argc, char *argv[])
+{
+    int reps = parse_reps(&argc, &argv);
+    struct source *srcs;
+    size_t bytes;
+    int count = read_sources(argc, argv, &srcs, &bytes);
+
+    struct bm_parse_ctx ctx;
+    bm_init_ctx(&ctx);
+    double t[4] = { 0 };
+    long events = 0, found[2] = { 0 };
+
+    for (int i = 0; i < count; i++) {
+        struct bm_chart chart;
+        struct bm_seq seq;
+        bm_load_ctx(&ctx, &chart, srcs[i].buf, srcs[i].len, 0);
+        bm_to_seq_ex(&chart, &seq, 48, BM_SEQ_SOA);
+        int end = (seq.event_count > 0 ? seq.events[seq.event_count - 1].pos : 0);
+        int buckets = end / seq.resolution + 1;
+        int *hist = (int *)calloc(buckets, sizeof(int));
+        events += (long)seq.event_count * reps;
+
+        // Windows of four bars sliding over the chart, on all key tracks
+        clock_t start = clock();
+        for (int r = 0; r < reps; r++)
+            found[0] += count_aos(&seq, 11 + r % 9, r * 96 % (end + 1), r * 96 % (end + 1) + 768);
+        t[0] += (double)(clock() - start) / CLOCKS_PER_SEC;
+        start = clock();
+        for (int r = 0; r < reps; r++)
+            found[1] += count_soa(&seq, 11 + r % 9, r * 96 % (end + 1), r * 96 % (end + 1) + 768);
+        t[1] += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        start = clock();
+        for (int r = 0; r < reps; r++) density_aos(&seq, hist, buckets);
+        t[2] += (double)(clock() - start) / CLOCKS_PER_SEC;
+        start = clock();
+        for (int r = 0; r < reps; r++) density_soa(&seq, hist, buckets);
+        t[3] += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        free(hist);
+        bm_close_seq(&seq);
+        bm_close_chart(&chart);
+    }
+    bm_close_ctx(&ctx);
+    free_sources(srcs, count);
+
+    if (found[0] != found[1]) fprintf(stderr, "Layouts disagree\n");
+    printf("%d chart%s, %d repetition%s, %ld events scanned per kernel\n",
+        count, count == 1 ? "" : "s", reps, reps == 1 ? "" : "s", events);
+    static const char *names[] = {
+        "Range count, AoS", "Range count, SoA", "Density, AoS", "Density, SoA"
+    };
+    for (int k = 0; k < 4; k++) {
+        printf("%-24s %8.3f s  %8.2f M events/s", names[k], t[k],
+            t[k] > 0 ? events / t[k] / 1e6 : 0);
+        if (k % 2 == 1 && t[k] > 0) printf("  %5.2fx", t[k - 1] / t[k]);
+        putchar('\n');
+    }
+    return 0;
+}
+
+// Counts what goes through the allocator hooks; one per job,
+// so that no synchronization is needed
+struct alloc_count {
+    size_t calls, bytes;
+};
+
+static void *count_alloc(void *user, size_t size)
+{
+    struct alloc_count *c = (struct alloc_count *)user;
+    c->calls++;
+    c->bytes += size;
+    return malloc(size);
+}
+
+static void *count_realloc(void *user, void *ptr, size_t size)
+{
+    struct alloc_count *c = (struct alloc_count *)user;
+    c->calls++;
+    c->bytes += size;
+    return realloc(ptr, size);
+}
+
+static void count_free(void *user, void *ptr)
+{
+    (void)user;
+    free(ptr);
+}
+
+static int bench_load(int argc, char *argv[])
+{
+    int threads = 0;
+    int to_seq = 1;
+    int flags = 0;
+    int count_allocs = 0;
+
+    int i = 0;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0) {
+            to_seq = 0;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            flags |= BM_LOAD_META_ONLY | BM_LOAD_NO_TABLES;
+            to_seq = 0;
+        } else if (strcmp(argv[i], "-e") == 0) {
+            flags |= BM_LOAD_STOP_EARLY;
+        } else if (strcmp(argv[i], "-a") == 0) {
+            count_allocs = 1;
+        } else if (strcmp(argv[i], "-q") == 0) {
+            flags |= BM_LOAD_NO_LOGS;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    int count = argc - i;
+    struct bm_load_job *jobs = (struct bm_load_job *)
+        calloc(count > 0 ? count : 1, sizeof(struct bm_load_job));
+    struct alloc_count *counts = NULL;
+    struct bm_allocator *allocs = NULL;
+    if (count_allocs) {
+        counts = (struct alloc_count *)
+            calloc(count > 0 ? count : 1, sizeof(struct alloc_count));
+        allocs = (struct bm_allocator *)
+            calloc(count > 0 ? count : 1, sizeof(struct bm_allocator));
+    }
+    for (int j = 0; j < count; j++) {
+        jobs[j].path = argv[i + j];
+        jobs[j].to_seq = to_seq;
+        if (count_allocs) {
+            allocs[j].alloc_fn = count_alloc;
+            allocs[j].realloc_fn = count_realloc;
+            allocs[j].free_fn = count_free;
+            allocs[j].user = &counts[j];
+            jobs[j].alloc = &allocs[j];
+        }
+    }
+
+    struct bm_batch_stats stats;
+    if (bm_load_many(jobs, count, threads, flags, &stats) == -1) {
+        fprintf(stderr, "Out of memory\n");
+        free(jobs);
+        free(counts);
+        free(allocs);
+        return 1;
+    }
+
+    int logs = 0;
+    for (int j = 0; j < count; j++) {
+        if (jobs[j].result == -1)
+            fprintf(stderr, "Cannot open %s\n", jobs[j].path);
+        else
+            logs += jobs[j].ctx.log_total;
+        bm_close_job(&jobs[j]);
+    }
+    free(jobs);
+
+    size_t calls = 0, alloc_bytes = 0;
+    for (int j = 0; count_allocs && j < count; j++) {
+        calls += counts[j].calls;
+        alloc_bytes += counts[j].bytes;
+    }
+    free(counts);
+    free(allocs);
+
+    printf("%d chart%s (%d failed), %d warning%s, %d thread%s\n",
+        stats.job_count, stats.job_count == 1 ? "" : "s", stats.failed_count,
+        logs, logs == 1 ? "" : "s",
+        stats.thread_count, stats.thread_count == 1 ? "" : "s");
+    printf("%.2f MiB in %.3f s: %.2f MiB/s, %.1f charts/s\n",
+        stats.bytes / 1048576.0, stats.wall_seconds,
+        stats.bytes_per_second / 1048576.0, stats.jobs_per_second);
+    printf("Latency (ms): min %.3f, mean %.3f, p50 %.3f, p99 %.3f, max %.3f\n",
+        stats.latency_min * 1e3, stats.latency_mean * 1e3,
+        stats.latency_p50 * 1e3, stats.latency_p99 * 1e3,
+        stats.latency_max * 1e3);
+    if (count_allocs && count > 0)
+        printf("Allocations: %zu (%.1f per chart), %.2f MiB\n",
+            calls, (double)calls / count, alloc_bytes / 1048576.0);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "load") == 0)
+        return bench_load(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "scan") == 0)
+        return bench_scan(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "memory") == 0)
+        return bench_memory(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "compiled") == 0)
+        return bench_compiled(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "stream") == 0)
+        return bench_stream(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "sax") == 0)
+        return bench_sax(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "variants") == 0)
+        return bench_variants(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "sort") == 0)
+        return bench_sort(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "seq") == 0)
+        return bench_seq(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "timing") == 0)
+        return bench_timing(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "layout") == 0)
+        return bench_layout(argc - 2, argv + 2);
+
+    fprintf(stderr,
+        "usage: %s load [-j threads] [-c] [-m [-e]] [-a] [-q] <file>...\n"
+        "  Loads all files in parallel and reports throughput and latency\n"
+        "  -c skips the conversion into event sequences\n"
+        "  -m only reads metadata, -e stops reading once it is complete\n"
+        "  -a counts allocations through the allocator hooks\n"
+        "  -q keeps no diagnostics\n"
+        "usage: %s scan [-n repetitions] <file>...\n"
+        "  Compares vectorized and scalar line scanning, and the cost of digests\n"
+        "usage: %s memory <file>...\n"
+        "  Compares the memory used by loaded charts and their compact forms\n"
+        "usage: %s compiled [-n repetitions] <file>...\n"
+        "  Compares parsing charts with reloading them from compiled files\n"
+        "usage: %s stream [-n repetitions] [-s chunk size] <file>...\n"
+        "  Compares loading whole buffers with feeding them in chunks\n"
+        "usage: %s sax [-n repetitions] <file>...\n"
+        "  Compares loading charts with callback parsing that builds nothing\n"
+        "usage: %s variants [-n repetitions] <file>...\n"
+        "  Loads every #RANDOM variant (up to 1024 per chart), each cut out of\n"
+        "  the source and parsed, and from branches parsed once\n"
+        "usage: %s sort [-n repetitions] [notes]\n"
+        "  Loads generated charts (200000 notes by default) whose bars are\n"
+        "  in order, reversed and shuffled\n"
+        "usage: %s seq [-n repetitions] <file>...\n"
+        "  Times the conversion of loaded charts into event sequences\n"
+        "usage: %s timing [-n repetitions] <file>...\n"
+        "  Times tempo maps: building, filling event times and lookups\n"
+        "usage: %s layout [-n repetitions] <file>...\n"
+        "  Compares filtering passes over events and over columns\n",
+        argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+        argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+}
@@ -21,6 +21,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef _WIN32
@@ -500,32 +501,18 @@ int main(int argc, char *argv[])
 
 // -- Application logic --
 
-static char *read_file(const char *path)
-{
-    FILE *f = fopen(path, "rb");
-    if (f == NULL) return NULL;
-
-    char *buf = NULL;
-
-    do {
-        if (fseek(f, 0, SEEK_END) != 0) break;
-        long len = ftell(f);
-        if (fseek(f, 0, SEEK_SET) != 0) break;
-        if ((buf = (char *)malloc(len + 1)) == NULL) break;
-        if (fread(buf, len, 1, f) != 1) { free(buf); buf = NULL; break; }
-        buf[len] = 0;
-    } while (0);
-
-    fclose(f);
-    return buf;
-}
-
 static int msgs_count;
 static struct bm_chart chart;
 static struct bm_seq seq;
+static struct bm_timing timing;
+static struct bm_seq_index seq_index;
+static struct bm_seq_cursor visible;
+static int *visible_lns;
+static int visible_lns_cap;
 
 static bool is_bms_sp;
 static bool is_9k;
+static int bg_tracks;   // Background tracks as they appear in `seq`
 
 #define MSGS_FADE_OUT_TIME  0.2
 static float msgs_show_time = -MSGS_FADE_OUT_TIME;
@@ -578,7 +565,7 @@ static float bwd_range;
 #define Y_POS(__pos)    (((__pos) - play_pos) * scroll_speed + HITLINE_POS)
 
 static bool playing = false;
-static float current_bpm;   // Will be re-initialized on playback start
+static double play_time;    // Will be re-initialized on playback start
 static int event_ptr;
 
 static float ss_target;
@@ -790,25 +777,31 @@ static ma_thread_result MA_THREADCALL flatspin_load_audio(void *data)
 
 static int flatspin_init()
 {
-    char *src = read_file(flatspin_bmspath);
-    if (src == NULL) {
+    msgs_count = bm_load_file(&chart, flatspin_bmspath);
+    if (msgs_count == -1) {
         fprintf(stderr, "> <  Cannot load BMS file %s\n", flatspin_bmspath);
         return 1;
     }
 
-    msgs_count = bm_load(&chart, src);
-    free(src);
-
     is_bms_sp = (chart.meta.player_num == 1);
     is_9k = (chart.meta.player_num == 3);
     if (!is_bms_sp && !is_9k) is_bms_sp = true;
+    bg_tracks = (chart.tracks.background_count < BM_BGM_TRACKS ?
+        chart.tracks.background_count : BM_BGM_TRACKS);
 
     bm_to_seq(&chart, &seq);
+    if (bm_build_timing(&timing, &seq, chart.meta.init_tempo) != 0 ||
+        bm_build_index(&seq_index, &seq) != 0)
+    {
+        fprintf(stderr, "> <  Out of memory\n");
+        return 1;
+    }
+    bm_cursor_init(&visible, &seq);
     msgs_show_time = 10;
 
     unit = 2.0f / (
         (is_bms_sp ? (SCRATCH_WIDTH + KEY_WIDTH * 7) : KEY_WIDTH * 9) +
-        BGTRACK_WIDTH * chart.tracks.background_count);
+        BGTRACK_WIDTH * bg_tracks);
 
     play_pos = 0;
     scroll_speed = SS_INITIAL;  // Screen Y units per 1/48 beat
@@ -979,17 +972,16 @@ static void flatspin_update(float dt)
     }
 
     if (play_started) {
-        // Current BPM needs to be updated
+        // Current time needs to be updated
         // BGA needs an update as well, but our application doesn't display BGAs
-        // XXX: Can be replaced with binary search
-        current_bpm = chart.meta.init_tempo;
-        int i;
-        for (i = 0; i < seq.event_count; i++) {
-            struct bm_event ev = seq.events[i];
-            if (ev.pos >= play_pos) break;
-            if (ev.type == BM_TEMPO_CHANGE) current_bpm = ev.value_f;
+        play_time = bm_tick_to_seconds(&timing, play_pos);
+        int lo = -1, hi = seq.event_count, mid;
+        while (lo < hi - 1) {
+            mid = (lo + hi) >> 1;
+            if (seq.events[mid].pos < play_pos) lo = mid;
+            else hi = mid;
         }
-        event_ptr = i;
+        event_ptr = hi;
     }
     if (play_cut || play_started) {
         // Stop all sounds
@@ -1026,16 +1018,15 @@ static void flatspin_update(float dt)
     }
 
     if (playing) {
-        play_pos += dt * current_bpm * (48.0f / 60.0f);
+        // Tempo changes and stops are taken care of by the timing map
+        play_time += dt;
+        play_pos = bm_seconds_to_tick(&timing, play_time);
 
         float x, w, r, g, b;
 
         while (event_ptr < seq.event_count && seq.events[event_ptr].pos <= play_pos) {
             struct bm_event ev = seq.events[event_ptr];
             switch (ev.type) {
-            case BM_TEMPO_CHANGE:
-                current_bpm = ev.value_f;
-                break;
             case BM_NOTE:
             case BM_NOTE_LONG:
                 pcm_track[ev.value] = track_index(ev.track);
@@ -1084,7 +1075,7 @@ static void flatspin_update(float dt)
             for (int i = 11; i <= 15; i++) process_track(i);
             for (int i = 22; i <= 25; i++) process_track(i);
         }
-        for (int i = 0; i < chart.tracks.background_count; i++)
+        for (int i = 0; i < bg_tracks; i++)
             process_track(-i);
 
         msq_accum_size = 0;
@@ -1103,20 +1094,16 @@ static void flatspin_update(float dt)
         for (int i = 11; i <= 15; i++) draw_track_background(i);
         for (int i = 22; i <= 25; i++) draw_track_background(i);
     }
-    for (int i = 0; i < chart.tracks.background_count; i++)
+    for (int i = 0; i < bg_tracks; i++)
         draw_track_background(-i);
 
-    int start = 0;
-    int lo = -1, hi = seq.event_count, mid;
-    while (lo < hi - 1) {
-        mid = (lo + hi) >> 1;
-        if (seq.events[mid].pos < play_pos - bwd_range) lo = mid;
-        else hi = mid;
-    }
-    start = hi;
+    int range_lo = (int)ceilf(play_pos - bwd_range);
+    int range_hi = (int)floorf(play_pos + fwd_range);
+    bm_cursor_seek(&visible, range_lo, range_hi);
+    int start = visible.lo, end = visible.hi;
 
     char s[12];
-    for (int i = start; i < seq.event_count && seq.events[i].pos <= play_pos + fwd_range; i++) {
+    for (int i = start; i < end; i++) {
         float bpm = -1;
         if (seq.events[i].type == BM_BARLINE) {
             if (seq.events[i].pos == seq.events[seq.event_count - 1].pos) {
@@ -1146,7 +1133,7 @@ static void flatspin_update(float dt)
         }
     }
 
-    for (int i = start; i < seq.event_count && seq.events[i].pos <= play_pos + fwd_range; i++) {
+    for (int i = start; i < end; i++) {
         struct bm_event ev = seq.events[i];
         if (ev.type == BM_NOTE) {
             float x, w, r, g, b;
@@ -1157,18 +1144,26 @@ static void flatspin_update(float dt)
         }
     }
 
-    for (int i = 0; i < seq.long_note_count; i++) {
-        struct bm_event ev = seq.long_notes[i];
-        if (ev.pos <= play_pos + fwd_range &&
-            ev.pos + ev.value_a >= play_pos - bwd_range)
-        {
-            float x, w, r, g, b;
-            track_attr(ev.track, &x, &w, &r, &g, &b);
-            add_rect(x, Y_POS(ev.pos), w,
-                0.02f + ev.value_a * scroll_speed,
-                r, g, b, true);
+    int ln_count = bm_query_long_notes(&seq_index, range_lo, range_hi,
+        visible_lns, visible_lns_cap);
+    if (ln_count > visible_lns_cap) {
+        int *p = (int *)realloc(visible_lns, ln_count * sizeof(int));
+        if (p != NULL) {
+            visible_lns = p;
+            visible_lns_cap = ln_count;
+            bm_query_long_notes(&seq_index, range_lo, range_hi, visible_lns, ln_count);
+        } else {
+            ln_count = visible_lns_cap;
         }
     }
+    for (int i = 0; i < ln_count; i++) {
+        struct bm_event ev = seq.long_notes[visible_lns[i]];
+        float x, w, r, g, b;
+        track_attr(ev.track, &x, &w, &r, &g, &b);
+        add_rect(x, Y_POS(ev.pos), w,
+            0.02f + ev.value_a * scroll_speed,
+            r, g, b, true);
+    }
 
     // Hit line
     add_rect(-1, HITLINE_POS, 2, HITLINE_H, 1.0, 0.7, 0.4, false);
@@ -1191,8 +1186,10 @@ static void flatspin_update(float dt)
             } else {
                 add_char(-0.95 + TEXT_W * 3, y, 1.0, 1.0, 0.7, alpha, '>');
             }
+            char message[BM_MSG_LEN];
+            bm_log_message(&bm_logs[i], message, sizeof message);
             int lines = add_text_w(-0.95 + TEXT_W * 5, y,
-                line_w, 0.95, 0.95, 0.9, alpha, bm_logs[i].message);
+                line_w, 0.95, 0.95, 0.9, alpha, message);
             y -= TEXT_H * (lines + 0.75);
         }
         if (msgs_count > disp_count) {
@@ -1297,6 +1294,9 @@ static void flatspin_cleanup()
 
     bm_close_chart(&chart);
     bm_close_seq(&seq);
+    bm_close_timing(&timing);
+    bm_close_index(&seq_index);
+    free(visible_lns);
 }
 
 // ffmpeg -f rawvideo -pix_fmt gray - -i font.png | hexdump -ve '1/1 "%.2x"' | fold -w96 | sed -e 's/00/0,/g' | sed -e 's/ff/1,/g'
@@ -1,42 +1,22 @@
 #include <stdio.h>
-#include <stdlib.h>
 
 #include "bmflat.h"
 
-char *read_file(const char *path)
-{
-    FILE *f = fopen(path, "r");
-    if (f == NULL) return NULL;
-
-    char *buf = NULL;
-
-    do {
-        if (fseek(f, 0, SEEK_END) != 0) break;
-        long len = ftell(f);
-        if (fseek(f, 0, SEEK_SET) != 0) break;
-        if ((buf = (char *)malloc(len)) == NULL) break;
-        if (fread(buf, len, 1, f) != 1) { free(buf); buf = NULL; break; }
-    } while (0);
-
-    fclose(f);
-    return buf;
-}
-
 int main(int argc, char *argv[])
 {
     const char *path = (argc >= 2 ? argv[1] : "sample.bms");
-    char *src = read_file(path);
-    if (src == NULL) {
+    struct bm_chart chart;
+    int msgs = bm_load_file(&chart, path);
+    if (msgs == -1) {
         printf("Cannot open %s\n", path);
         return 1;
     }
 
-    struct bm_chart chart;
-    int msgs = bm_load(&chart, src);
-
     printf("%d warning%s\n", msgs, msgs == 1 ? "" : "s");
+    char message[BM_MSG_LEN];
     for (int i = 0; i < msgs; i++) {
-        printf("Line %d: %s\n", bm_logs[i].line, bm_logs[i].message);
+        bm_log_message(&bm_logs[i], message, sizeof message);
+        printf("Line %d: %s\n", bm_logs[i].line, message);
     }
 
     puts("----");
@@ -198,7 +178,7 @@ int main(int argc, char *argv[])
         printf("%d %d\n", seq.event_count, seq.long_note_count);
         bm_close_chart(&chart);
         bm_close_seq(&seq);
-        bm_load(&chart, src);
+        bm_load_file(&chart, path);
         bm_to_seq(&chart, &seq);
     }
 
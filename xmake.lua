@@ -24,6 +24,20 @@ target('flattest')
     add_files('bmflat.c')
     add_files('examples/flattest.c')
     add_files('examples/sample.bms')
+    if is_plat('linux') then
+        add_syslinks('pthread')
+    end
+
+target('flatbench')
+    set_kind('binary')
+    add_includedirs('.')
+    add_headerfiles('bmflat.h')
+    add_files('bmflat.c')
+    add_files('examples/flatbench.c')
+    set_optimize('fastest')
+    if is_plat('linux') then
+        add_syslinks('pthread')
+    end
 
 target('flatspin')
     set_kind('binary')